@@ -0,0 +1,471 @@
+/*****************************************************************
+* Workload generator and benchmark driver for the fs server.
+*
+* Opens several connections to the server, gives each one its own
+* directory, and issues a configurable mix of mk, mkdir, w, i, d, a,
+* cat, ls and rm requests against it. Load is either closed-loop
+* (every connection waits for its reply before the next request)
+* or open-loop (requests arrive at a fixed aggregate rate whatever
+* the server does; latency is measured from the intended send time).
+*
+* The report is one JSON object on stdout, with ops/s and
+* p50/p99/p999 latency per command type, so runs can be appended to
+* a file and compared; a readable summary goes to stderr.
+******************************************************************/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <netdb.h>
+
+#define MAX_CONN		(256)
+#define MAX_OUTSTANDING	(1024)
+#define MAX_DATA		(4000)	/* the server parses data into 4096 bytes */
+#define MAX_LINE		(8192)
+
+enum { OP_MK, OP_MKDIR, OP_W, OP_I, OP_D, OP_A, OP_CAT, OP_LS, OP_RM, OP_NUM };
+
+const char *op_names[OP_NUM] = { "mk", "mkdir", "w", "i", "d", "a", "cat", "ls", "rm" };
+
+enum { DIST_FIXED, DIST_UNIFORM, DIST_EXP };
+
+typedef struct {
+	int kind;
+	double a, b;
+} Dist;
+
+typedef struct {
+	char **path;
+	int *depth;		/* directories: depth below the connection's directory */
+	int *size;		/* files: current length */
+	int n, cap;
+} Names;
+
+typedef struct {
+	int sock;
+	char in[MAX_LINE * 4];
+	int inlen;
+	long long body;	/* bytes of a cat reply still to come after its length */
+	int qop[MAX_OUTSTANDING];
+	double qt[MAX_OUTSTANDING];
+	int qhead, qlen;
+	Names files, dirs;
+	int serial;
+	double next_at;
+} Conn;
+
+typedef struct {
+	double *lat;
+	int n, cap;
+	long long errors;
+} OpStats;
+
+double mix[OP_NUM] = { 10, 2, 25, 10, 10, 0, 30, 5, 8 };
+Dist size_dist = { DIST_UNIFORM, 1, 512 };
+Dist depth_dist = { DIST_UNIFORM, 0, 3 };
+OpStats stats[OP_NUM];
+
+double now_us() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+/* fixed:N, uniform:A:B or exp:MEAN */
+int parse_dist(const char *s, Dist *d) {
+	if (sscanf(s, "fixed:%lf", &d->a) == 1) d->kind = DIST_FIXED;
+	else if (sscanf(s, "uniform:%lf:%lf", &d->a, &d->b) == 2) d->kind = DIST_UNIFORM;
+	else if (sscanf(s, "exp:%lf", &d->a) == 1) d->kind = DIST_EXP;
+	else return -1;
+	return 0;
+}
+
+int sample(Dist *d) {
+	switch (d->kind) {
+	case DIST_FIXED:
+		return (int) d->a;
+	case DIST_UNIFORM:
+		return (int) (d->a + drand48() * (d->b - d->a + 1));
+	default:
+		return (int) (-log(1 - drand48()) * d->a);
+	}
+}
+
+/* mk=10,w=30,... ; commands that are not named get weight 0 */
+int parse_mix(char *s) {
+	char *item, *eq;
+	int i;
+	for (i = 0; i < OP_NUM; i++) mix[i] = 0;
+	while ((item = strsep(&s, ",")) != NULL) {
+		if ((eq = strchr(item, '=')) == NULL) return -1;
+		*eq = 0;
+		for (i = 0; i < OP_NUM; i++)
+			if (strcmp(item, op_names[i]) == 0) break;
+		if (i == OP_NUM) return -1;
+		mix[i] = atof(eq + 1);
+	}
+	return 0;
+}
+
+int choose_op() {
+	double total = 0, x;
+	int i;
+	for (i = 0; i < OP_NUM; i++) total += mix[i];
+	x = drand48() * total;
+	for (i = 0; i < OP_NUM - 1; i++) {
+		if (x < mix[i]) return i;
+		x -= mix[i];
+	}
+	return OP_NUM - 1;
+}
+
+void names_add(Names *names, const char *path, int depth) {
+	if (names->n == names->cap) {
+		names->cap = names->cap ? names->cap * 2 : 64;
+		names->path = realloc(names->path, sizeof(char *) * names->cap);
+		names->depth = realloc(names->depth, sizeof(int) * names->cap);
+		names->size = realloc(names->size, sizeof(int) * names->cap);
+	}
+	names->path[names->n] = strdup(path);
+	names->depth[names->n] = depth;
+	names->size[names->n] = 0;
+	names->n++;
+}
+
+void names_remove(Names *names, int i) {
+	free(names->path[i]);
+	names->n--;
+	names->path[i] = names->path[names->n];
+	names->depth[i] = names->depth[names->n];
+	names->size[i] = names->size[names->n];
+}
+
+/* A random directory at the sampled depth, or at the deepest level above it */
+int pick_dir(Conn *c) {
+	int target = sample(&depth_dist), best = -1, pick = 0, n = 0, i;
+	for (i = 0; i < c->dirs.n; i++) {
+		int depth = c->dirs.depth[i];
+		if (depth > target || depth < best) continue;
+		if (depth > best) {
+			best = depth;
+			n = 0;
+		}
+		if (drand48() * ++n < 1) pick = i;
+	}
+	return pick;
+}
+
+void fill(char *data, int len) {
+	int i;
+	for (i = 0; i < len; i++) data[i] = 'a' + (i * 7 + len) % 26;
+	data[len] = 0;
+}
+
+int clamp(int x, int lo, int hi) {
+	return x < lo ? lo : x > hi ? hi : x;
+}
+
+/* Build the next request for the connection and update its model of the
+   namespace as if the request succeeds */
+int gen_request(Conn *c, int op, char *line) {
+	char path[MAX_LINE], data[MAX_DATA + 1];
+	int f = -1, d, len, pos;
+
+	if ((op == OP_W || op == OP_I || op == OP_D || op == OP_A || op == OP_CAT || op == OP_RM) && c->files.n == 0) op = OP_MK;
+	if (c->files.n) f = (int) (drand48() * c->files.n);
+	switch (op) {
+	case OP_MK:
+	case OP_MKDIR:
+		d = pick_dir(c);
+		sprintf(path, "%s%s%c%d", c->dirs.path[d], c->dirs.depth[d] ? "/" : "", op == OP_MK ? 'f' : 'd', c->serial++);
+		sprintf(line, "%s %s\n", op_names[op], path);
+		if (op == OP_MK) names_add(&c->files, path, c->dirs.depth[d] + 1);
+		else names_add(&c->dirs, path, c->dirs.depth[d] + 1);
+		break;
+	case OP_W:
+		len = clamp(sample(&size_dist), 1, MAX_DATA);
+		fill(data, len);
+		sprintf(line, "w %s %d %s\n", c->files.path[f], len, data);
+		c->files.size[f] = len;
+		break;
+	case OP_I:
+		len = clamp(sample(&size_dist), 1, MAX_DATA);
+		pos = (int) (drand48() * (c->files.size[f] + 1));
+		fill(data, len);
+		sprintf(line, "i %s %d %d %s\n", c->files.path[f], pos, len, data);
+		c->files.size[f] += len;
+		break;
+	case OP_A:
+		len = clamp(sample(&size_dist), 1, MAX_DATA);
+		fill(data, len);
+		sprintf(line, "a %s %d %s\n", c->files.path[f], len, data);
+		c->files.size[f] += len;
+		break;
+	case OP_D:
+		len = clamp(sample(&size_dist), 1, MAX_DATA);
+		pos = (int) (drand48() * c->files.size[f]);
+		if (pos + len > c->files.size[f]) len = c->files.size[f] - pos;
+		sprintf(line, "d %s %d %d\n", c->files.path[f], pos, len);
+		c->files.size[f] -= len;
+		break;
+	case OP_CAT:
+		sprintf(line, "cat %s\n", c->files.path[f]);
+		break;
+	case OP_LS:
+		sprintf(line, "ls\n");
+		break;
+	case OP_RM:
+		sprintf(line, "rm %s\n", c->files.path[f]);
+		names_remove(&c->files, f);
+		break;
+	}
+	return op;
+}
+
+int connect_to(int port) {
+	struct sockaddr_in addr;
+	struct hostent *host;
+	int s, one = 1;
+
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+		fprintf(stderr, "Socket error\n");
+		exit(1);
+	}
+	addr.sin_family = AF_INET;
+	host = gethostbyname("localhost");
+	addr.sin_port = htons(port);
+	memcpy(&addr.sin_addr.s_addr, host->h_addr, host->h_length);
+	if (connect(s, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		fprintf(stderr, "Connect error\n");
+		exit(1);
+	}
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return s;
+}
+
+void send_all(int s, const char *buf, int n) {
+	int k, done = 0;
+	while (done < n) {
+		if ((k = write(s, buf + done, n - done)) <= 0) {
+			fprintf(stderr, "Send error\n");
+			exit(1);
+		}
+		done += k;
+	}
+}
+
+/* Send a request and wait for its reply line, used for the setup */
+void call(Conn *c, const char *line, char *reply) {
+	int k;
+	char *nl;
+	send_all(c->sock, line, strlen(line));
+	while ((nl = memchr(c->in, '\n', c->inlen)) == NULL) {
+		if ((k = recv(c->sock, c->in + c->inlen, sizeof(c->in) - c->inlen, 0)) <= 0) {
+			fprintf(stderr, "Closed connection\n");
+			exit(1);
+		}
+		c->inlen += k;
+	}
+	*nl = 0;
+	if (reply) strcpy(reply, c->in);
+	c->inlen -= nl + 1 - c->in;
+	memmove(c->in, nl + 1, c->inlen);
+}
+
+void issue(Conn *c, double at) {
+	char line[MAX_LINE];
+	int op = gen_request(c, choose_op(), line);
+	int slot = (c->qhead + c->qlen) % MAX_OUTSTANDING;
+	c->qop[slot] = op;
+	c->qt[slot] = at;
+	c->qlen++;
+	send_all(c->sock, line, strlen(line));
+}
+
+void record(int op, double lat, int error) {
+	OpStats *st = &stats[op];
+	if (st->n == st->cap) {
+		st->cap = st->cap ? st->cap * 2 : 1024;
+		st->lat = realloc(st->lat, sizeof(double) * st->cap);
+	}
+	st->lat[st->n++] = lat;
+	if (error) st->errors++;
+}
+
+/* Read whatever arrived and match every complete reply to the oldest
+   outstanding request. A reply is a line, but for cat a line with the
+   length of the content, the content and a newline. */
+int collect(Conn *c) {
+	char *p, *nl, *end;
+	int k;
+	if ((k = recv(c->sock, c->in + c->inlen, sizeof(c->in) - c->inlen, 0)) <= 0) {
+		fprintf(stderr, "Closed connection\n");
+		exit(1);
+	}
+	c->inlen += k;
+	p = c->in;
+	end = c->in + c->inlen;
+	while (c->qlen) {
+		if (!c->body) {
+			if ((nl = memchr(p, '\n', end - p)) == NULL) break;
+			if (c->qop[c->qhead] == OP_CAT && *p >= '0' && *p <= '9') {
+				c->body = atoll(p) + 1;
+				p = nl + 1;
+				continue;
+			}
+			record(c->qop[c->qhead], now_us() - c->qt[c->qhead], strncmp(p, "No", 2) == 0 && nl - p == 2);
+			p = nl + 1;
+		} else {
+			long long n = end - p < c->body ? end - p : c->body;
+			p += n;
+			if ((c->body -= n)) break;
+			record(c->qop[c->qhead], now_us() - c->qt[c->qhead], 0);
+		}
+		c->qhead = (c->qhead + 1) % MAX_OUTSTANDING;
+		c->qlen--;
+	}
+	c->inlen -= p - c->in;
+	memmove(c->in, p, c->inlen);
+	if (c->inlen == sizeof(c->in)) c->inlen = 0;	/* a reply longer than the buffer */
+	return k;
+}
+
+int dblcmp(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+double pct(OpStats *st, double q) {
+	return st->n ? st->lat[(int) (q * (st->n - 1))] : 0;
+}
+
+void report(int nconn, double rate, double elapsed) {
+	int i, first = 1;
+	long long total = 0, errors = 0;
+
+	for (i = 0; i < OP_NUM; i++) {
+		qsort(stats[i].lat, stats[i].n, sizeof(double), dblcmp);
+		total += stats[i].n;
+		errors += stats[i].errors;
+	}
+	printf("{\"connections\":%d,\"mode\":\"%s\",\"rate\":%.0f,\"duration_s\":%.3f,"
+		"\"ops\":%lld,\"errors\":%lld,\"ops_per_s\":%.1f,\"commands\":{",
+		nconn, rate > 0 ? "open" : "closed", rate, elapsed / 1e6, total, errors, total / (elapsed / 1e6));
+	fprintf(stderr, "%-6s %9s %7s %10s %9s %9s %9s\n", "op", "count", "errors", "ops/s", "p50_us", "p99_us", "p999_us");
+	for (i = 0; i < OP_NUM; i++) {
+		if (!stats[i].n) continue;
+		printf("%s\"%s\":{\"count\":%d,\"errors\":%lld,\"ops_per_s\":%.1f,\"p50_us\":%.0f,\"p99_us\":%.0f,\"p999_us\":%.0f,\"max_us\":%.0f}",
+			first ? "" : ",", op_names[i], stats[i].n, stats[i].errors, stats[i].n / (elapsed / 1e6),
+			pct(&stats[i], 0.5), pct(&stats[i], 0.99), pct(&stats[i], 0.999), pct(&stats[i], 1));
+		fprintf(stderr, "%-6s %9d %7lld %10.1f %9.0f %9.0f %9.0f\n", op_names[i], stats[i].n, stats[i].errors,
+			stats[i].n / (elapsed / 1e6), pct(&stats[i], 0.5), pct(&stats[i], 0.99), pct(&stats[i], 0.999));
+		first = 0;
+	}
+	printf("}}\n");
+	fprintf(stderr, "total  %9lld %7lld %10.1f\n", total, errors, total / (elapsed / 1e6));
+}
+
+void usage(char *name) {
+	fprintf(stderr, "Usage: %s [-c connections] [-n ops | -t seconds] [-r rate] [-m mk=10,w=30,...]\n"
+		"\t[-s size_dist] [-d depth_dist] [-S seed] [-f] [-q] port\n"
+		"distributions: fixed:N, uniform:A:B or exp:MEAN\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	Conn *conns;
+	struct pollfd fds[MAX_CONN];
+	int nconn = 4, format = 0, quit = 0, opt, i;
+	long long nops = 10000, issued = 0;
+	double seconds = 0, rate = 0, start, deadline = 0, t;
+	char line[MAX_LINE], reply[MAX_LINE];
+
+	srand48(1);
+	while ((opt = getopt(argc, argv, "c:n:t:r:m:s:d:S:fq")) != -1) {
+		switch (opt) {
+		case 'c': nconn = clamp(atoi(optarg), 1, MAX_CONN); break;
+		case 'n': nops = atoll(optarg); break;
+		case 't': seconds = atof(optarg); break;
+		case 'r': rate = atof(optarg); break;
+		case 'm': if (parse_mix(optarg)) usage(argv[0]); break;
+		case 's': if (parse_dist(optarg, &size_dist)) usage(argv[0]); break;
+		case 'd': if (parse_dist(optarg, &depth_dist)) usage(argv[0]); break;
+		case 'S': srand48(atol(optarg)); break;
+		case 'f': format = 1; break;
+		case 'q': quit = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1) usage(argv[0]);
+
+	/* every connection works in a directory of its own, named after the run */
+	conns = calloc(nconn, sizeof(Conn));
+	for (i = 0; i < nconn; i++) {
+		Conn *c = &conns[i];
+		c->sock = connect_to(atoi(argv[optind]));
+		if (i == 0 && format) call(c, "f\n", NULL);
+		sprintf(line, "mkdir bench%d.%d\n", (int) getpid(), i);
+		call(c, line, NULL);
+		sprintf(line, "cd bench%d.%d\n", (int) getpid(), i);
+		call(c, line, reply);
+		if (strcmp(reply, "Yes") != 0) {
+			fprintf(stderr, "Cannot enter bench%d.%d, is the volume formatted?\n", (int) getpid(), i);
+			exit(1);
+		}
+		names_add(&c->dirs, "", 0);
+		fds[i].fd = c->sock;
+		fds[i].events = POLLIN;
+	}
+
+	start = now_us();
+	if (seconds > 0) {
+		deadline = start + seconds * 1e6;
+		nops = -1;
+	}
+	for (i = 0; i < nconn; i++) {
+		conns[i].next_at = start;
+		if (rate > 0) conns[i].next_at += -log(1 - drand48()) * 1e6 * nconn / rate;
+	}
+	for (;;) {
+		int timeout = 100, busy = 0;
+		t = now_us();
+		for (i = 0; i < nconn; i++) {
+			Conn *c = &conns[i];
+			int more = (nops < 0 || issued < nops) && (!deadline || t < deadline);
+			if (rate > 0) {
+				/* open loop: send everything that is due, on schedule */
+				while (more && c->next_at <= t && c->qlen < MAX_OUTSTANDING) {
+					issue(c, c->next_at);
+					issued++;
+					c->next_at += -log(1 - drand48()) * 1e6 * nconn / rate;
+					more = (nops < 0 || issued < nops) && (!deadline || c->next_at < deadline);
+				}
+				if (more && (c->next_at - t) / 1000 < timeout) timeout = (int) ((c->next_at - t) / 1000);
+			} else if (more && c->qlen == 0) {
+				issue(c, t);
+				issued++;
+			}
+			busy |= more || c->qlen;
+		}
+		if (!busy) break;
+		if (poll(fds, nconn, timeout) < 0) break;
+		for (i = 0; i < nconn; i++)
+			if (fds[i].revents & (POLLIN | POLLHUP)) collect(&conns[i]);
+	}
+	report(nconn, rate, now_us() - start);
+	for (i = 0; i < nconn; i++) {
+		if (quit && i == nconn - 1) call(&conns[i], "e\n", NULL);
+		close(conns[i].sock);
+	}
+	return 0;
+}
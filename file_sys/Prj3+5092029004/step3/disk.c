@@ -9,13 +9,33 @@
 #include <sys/mman.h>
 #include <sys/un.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 
 #define sector_size 256
 #define buffersize 4096
+#define max_transfer 256	// sectors per r or w instruction
+
+#define max_layers 8
+
+// A delta file is a sequence of records: the sector number followed by the
+// sector_size bytes of its content. The index is rebuilt from the records
+// when the layer is opened; the last record of a sector wins.
+typedef struct {
+	int fd;
+	int nslot;
+	int *index;		// sector -> slot + 1, 0 if the layer does not hold the sector
+	int *sectors;	// slot -> sector, so a reset only touches written sectors
+} DiskLayer;
 
 typedef struct {
-	char *a;
+	char *a;		// mmapped image when there are no overlay layers
+	char *base;		// base image path, reopened for writing on commit
+	int base_fd;
+	int nsector;
+	int num_sector;
+	int nlayer;
+	DiskLayer layers[max_layers];
 } DiskMap;
 
 typedef struct {
@@ -29,11 +49,100 @@ typedef struct {
 	double track_time;
 } Disk;
 
-DiskMap* disk_map_open(char* disk_storage, int *fd, int length) {
+void disk_layer_open(DiskLayer *layer, char *path, int nsector) {
+	char record[4 + sector_size];
+	int sector;
+
+	layer->fd = open(path, O_RDWR | O_CREAT, S_IWRITE | S_IREAD);
+	if (layer->fd < 0) {
+		fprintf(stderr, "Delta file %s open error!\n", path);
+		exit(-1);
+	}
+	layer->index = calloc(nsector, sizeof(int));
+	layer->sectors = malloc(sizeof(int) * nsector);
+	layer->nslot = 0;
+	while (pread(layer->fd, record, sizeof(record), (off_t) layer->nslot * sizeof(record)) == sizeof(record)) {
+		memcpy(&sector, record, 4);
+		if (sector < 0 || sector >= nsector) {
+			fprintf(stderr, "Delta file %s is corrupted!\n", path);
+			exit(-1);
+		}
+		layer->index[sector] = layer->nslot + 1;
+		layer->sectors[layer->nslot++] = sector;
+	}
+}
+
+// Drop every record of the layer; only the sectors written to it are touched
+void disk_layer_reset(DiskLayer *layer) {
+	int i;
+
+	for (i = 0; i < layer->nslot; ++i) layer->index[layer->sectors[i]] = 0;
+	layer->nslot = 0;
+	if (ftruncate(layer->fd, 0) < 0) fprintf(stderr, "Delta truncate error!\n");
+}
+
+void disk_layer_write(DiskLayer *layer, int sector, char buf[sector_size]) {
+	char record[4 + sector_size];
+	int slot;
+
+	slot = layer->index[sector] - 1;
+	if (slot < 0) {
+		slot = layer->nslot++;
+		layer->index[sector] = slot + 1;
+		layer->sectors[slot] = sector;
+	}
+	memcpy(record, &sector, 4);
+	memcpy(record + 4, buf, sector_size);
+	if (pwrite(layer->fd, record, sizeof(record), (off_t) slot * sizeof(record)) != sizeof(record))
+		fprintf(stderr, "Delta write error!\n");
+}
+
+// Read a whole sector from the topmost layer holding it, or the base image
+void disk_map_read_sector(DiskMap *map, int sector, char buf[sector_size]) {
+	int i, n = 0;
+
+	for (i = map->nlayer - 1; i >= 0; --i) {
+		if (map->layers[i].index[sector]) {
+			n = pread(map->layers[i].fd, buf, sector_size, (off_t) (map->layers[i].index[sector] - 1) * (4 + sector_size) + 4);
+			break;
+		}
+	}
+	if (i < 0) n = pread(map->base_fd, buf, sector_size, (off_t) sector * sector_size);
+	if (n < 0) n = 0;
+	memset(buf + n, 0, sector_size - n);
+}
+
+// The image argument is either a plain image, or a base image followed by
+// one or more delta files, separated by ':'. The base and the lower deltas
+// are never written; all writes go to the topmost delta.
+DiskMap* disk_map_open(char* disk_storage, int *fd, int length, int num_sector) {
 	DiskMap *map;
 	map = malloc(sizeof(DiskMap));
 	int res;
 	off_t result;
+	char *path, *delta;
+
+	map->nsector = length / sector_size;
+	map->num_sector = num_sector;
+	map->nlayer = 0;
+	map->a = NULL;
+	if ((delta = strchr(disk_storage, ':')) != NULL) {
+		*delta++ = 0;
+		map->base = disk_storage;
+		map->base_fd = *fd = open(disk_storage, O_RDONLY);
+		if (*fd < 0) {
+			fprintf(stderr, "Dist_storage open error!\n");
+			exit(-1);
+		}
+		while ((path = strsep(&delta, ":")) != NULL) {
+			if (map->nlayer == max_layers) {
+				fprintf(stderr, "Too many delta layers!\n");
+				exit(-1);
+			}
+			disk_layer_open(&map->layers[map->nlayer++], path, map->nsector);
+		}
+		return map;
+	}
 
 	*fd = open(disk_storage, O_RDWR | O_SYNC | O_CREAT, S_IWRITE | S_IREAD);
 	if (*fd < 0) {
@@ -46,7 +155,7 @@ DiskMap* disk_map_open(char* disk_storage, int *fd, int length) {
 		close(*fd);
 		exit(-1);
 	}
-	map->a = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, *fd, 0);
+	map->a = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
 	if ((res = write(*fd, "", 1)) != 1) {
 		fprintf(stderr, "Error writing last byte!\n");
 		close(*fd);
@@ -57,24 +166,103 @@ DiskMap* disk_map_open(char* disk_storage, int *fd, int length) {
 
 void disk_map_read(DiskMap *map, int c, int s, int offset, char data[256]) {
 	int size;
+	int sector = c * map->num_sector + s;
+	char buf[sector_size];
+
+	if (map->nlayer) {
+		disk_map_read_sector(map, sector, buf);
+		memset(data, 0, sector_size);
+		memcpy(data, buf + offset, sector_size - offset);
+		return;
+	}
 	for (size = 0; size < sector_size; ++size) {
-		data[size] = map->a[c * s * sector_size + offset + size];
+		data[size] = map->a[sector * sector_size + offset + size];
 	}
 }
 
 void disk_map_write(DiskMap *map, int c, int s, int offset, char data[256]) {
-	strcpy(map->a + c * s * sector_size + offset, data);
+	int sector = c * map->num_sector + s;
+	char buf[sector_size];
+
+	if (map->nlayer) {
+		disk_map_read_sector(map, sector, buf);
+		strncpy(buf + offset, data, sector_size - offset);
+		disk_layer_write(&map->layers[map->nlayer - 1], sector, buf);
+		return;
+	}
+	strcpy(map->a + sector * sector_size + offset, data);
+}
+
+// Whole-sector transfers, used by the binary-safe r and w instructions
+void disk_map_read_sectors(DiskMap *map, int sector, int count, char *buf) {
+	int i;
+
+	if (map->nlayer) {
+		for (i = 0; i < count; ++i) disk_map_read_sector(map, sector + i, buf + i * sector_size);
+	}
+	else memcpy(buf, map->a + sector * sector_size, count * sector_size);
+}
+
+void disk_map_write_sectors(DiskMap *map, int sector, int count, char *buf) {
+	int i;
+
+	if (map->nlayer) {
+		for (i = 0; i < count; ++i) disk_layer_write(&map->layers[map->nlayer - 1], sector + i, buf + i * sector_size);
+	}
+	else memcpy(map->a + sector * sector_size, buf, count * sector_size);
+}
+
+// Fold the topmost delta into the layer beneath it, or into the base image
+// when it is the only one, and start the delta afresh
+int disk_map_commit(DiskMap *map) {
+	DiskLayer *top;
+	char buf[sector_size];
+	int i, fd = -1;
+
+	if (map->nlayer == 0) return 0;
+	top = &map->layers[map->nlayer - 1];
+	if (map->nlayer == 1 && (fd = open(map->base, O_WRONLY)) < 0) return 0;
+	for (i = 0; i < top->nslot; ++i) {
+		disk_map_read_sector(map, top->sectors[i], buf);
+		if (fd >= 0) {
+			if (pwrite(fd, buf, sector_size, (off_t) top->sectors[i] * sector_size) != sector_size) {
+				close(fd);
+				return 0;
+			}
+		}
+		else disk_layer_write(&map->layers[map->nlayer - 2], top->sectors[i], buf);
+	}
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+	disk_layer_reset(top);
+	return 1;
+}
+
+// Throw the topmost delta away, which resets the disk to the state below it
+int disk_map_discard(DiskMap *map) {
+	if (map->nlayer == 0) return 0;
+	disk_layer_reset(&map->layers[map->nlayer - 1]);
+	return 1;
 }
 
 void disk_map_close(DiskMap *map, int *fd, int length) {
-	munmap(map->a, length);
+	int i;
+
+	for (i = 0; i < map->nlayer; ++i) {
+		close(map->layers[i].fd);
+		free(map->layers[i].index);
+		free(map->layers[i].sectors);
+	}
+	if (map->a) munmap(map->a, length);
 	close(*fd);
 }
 
 Disk* disk_open(char* disk_storage, int cylinder, int sector, double tracktime, int *fd, int length) {
 	Disk *disk;
 	disk = malloc(sizeof(Disk));
-	disk->map = disk_map_open(disk_storage, fd, length);
+	disk->map = disk_map_open(disk_storage, fd, length, sector);
 	disk->geometry.num_cylinder = cylinder;
 	disk->geometry.num_sector = sector;
 	disk->track_time = tracktime;
@@ -101,6 +289,18 @@ int disk_write(Disk *disk, int c, int s, int offset, char data[256]) {
 	}
 }
 
+int disk_read_sectors(Disk *disk, int sector, int count, char *buf) {
+	if (sector < 0 || count <= 0 || count > max_transfer || sector + count > disk->geometry.num_cylinder * disk->geometry.num_sector) return 0;
+	disk_map_read_sectors(disk->map, sector, count, buf);
+	return 1;
+}
+
+int disk_write_sectors(Disk *disk, int sector, int count, char *buf) {
+	if (sector < 0 || count <= 0 || count > max_transfer || sector + count > disk->geometry.num_cylinder * disk->geometry.num_sector) return 0;
+	disk_map_write_sectors(disk->map, sector, count, buf);
+	return 1;
+}
+
 void disk_close(Disk *disk, int *fd, int length) {
 	disk_map_close(disk->map, fd, length);
 }
@@ -119,15 +319,18 @@ int main(int argc, char *argv[]) {
 	disk = disk_open(argv[4], cylinder_num, sector_num, atoi(argv[3]), fd, length);
 	char instr[100], ins[100];
 	char *data;	// To store the read or write data
-	data = malloc(sizeof(char) * sector_size);
-	FILE *outfile;
+	data = malloc(sizeof(char) * sector_size * max_transfer);
+	FILE *outfile, *infile;
+	int count;
 	int cylinder, sector, last_cylinder = 0, page_num, offset;
 	double tracktime;
-	int sd, file_sock;
+	int sd, file_sock, one = 1;
 	struct sockaddr_in name;
 	
 	// disk server socket
 	sd = socket(AF_INET, SOCK_STREAM, 0);
+	// a restarted disk must be able to take its port back to rejoin a mirror
+	setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
     name.sin_family		 = AF_INET;
     name.sin_addr.s_addr = htonl(INADDR_ANY);
     name.sin_port		 = htons(atoi(argv[5]));
@@ -145,11 +348,14 @@ int main(int argc, char *argv[]) {
     	fprintf(stderr, "Accept error\n");
     	exit(1);
     }
+    // replies are written in pieces, do not let Nagle hold the last one back
+    setsockopt(file_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
     printf("Connection with file system is established!\n");
     outfile = fdopen(file_sock, "w");
+    infile = fdopen(dup(file_sock), "r");
 	
 	for (; ;) {
-		recv(file_sock, ins, 100, 0);
+		if (fgets(ins, 100, infile) == NULL) break;
 		if (sscanf(ins, "%s", instr) != 1) fprintf(stderr, "Instruction error!\n");
 		// For instruction I
 		if (strcmp(instr, "I") == 0) {
@@ -186,13 +392,51 @@ int main(int argc, char *argv[]) {
 				last_cylinder = cylinder;
 			}
 		}
+		// For instruction r s n: reply Yes followed by n raw sectors from sector s
+		else if (strcmp(instr, "r") == 0) {
+			if (sscanf(ins, "%*s%d%d", &sector, &count) != 2 || disk_read_sectors(disk, sector, count, data) == 0) fprintf(outfile, "No\n");
+			else {
+				fprintf(outfile, "Yes\n");
+				fwrite(data, sector_size, count, outfile);
+				last_cylinder = (sector + count - 1) / sector_num;
+			}
+		}
+		// For instruction w s n followed by n raw sectors
+		else if (strcmp(instr, "w") == 0) {
+			if (sscanf(ins, "%*s%d%d", &sector, &count) != 2 || count <= 0) fprintf(outfile, "No\n");
+			else if (count > max_transfer) {
+				// the sectors were sent all the same, they must not be taken for instructions
+				for (; count > 0; count -= max_transfer) {
+					int n = count < max_transfer ? count : max_transfer;
+					if (fread(data, sector_size, n, infile) != (size_t) n) break;
+				}
+				if (count > 0) break;
+				fprintf(outfile, "No\n");
+			}
+			else if (fread(data, sector_size, count, infile) != (size_t) count) break;
+			else if (disk_write_sectors(disk, sector, count, data) == 0) fprintf(outfile, "No\n");
+			else {
+				fprintf(outfile, "Yes\n");
+				last_cylinder = (sector + count - 1) / sector_num;
+			}
+		}
+		// For instruction C: commit the topmost delta layer
+		else if (strcmp(instr, "C") == 0) {
+			fprintf(outfile, disk_map_commit(disk->map) ? "Yes\n" : "No\n");
+		}
+		// For instruction D: discard the topmost delta layer
+		else if (strcmp(instr, "D") == 0) {
+			fprintf(outfile, disk_map_discard(disk->map) ? "Yes\n" : "No\n");
+		}
 		// For instruction E
 		else if (strcmp(instr, "E") == 0) {
 			fprintf(outfile, "Goodbye!\n");
 			fclose(outfile);
 			break;
 		}
+		fflush(outfile);
 	}
+	fclose(infile);
 	close(file_sock);
 	close(sd);
 	disk_close(disk, fd, length);
@@ -0,0 +1,28 @@
+#!/bin/bash
+
+# Runs a few workloads against a fresh volume and appends one JSON line per
+# run to fsbench/results.json
+
+make
+mkdir -p fsbench
+PORT=${PORT:-5600}
+
+run() {
+	rm -f fsbench/disk.img
+	./disk 256 256 0 fsbench/disk.img $PORT > fsbench/disk.log &
+	sleep 0.2
+	./fs $PORT $((PORT + 1)) > fsbench/fs.log &
+	sleep 0.5
+	./bench -f -q "$@" $((PORT + 1)) >> fsbench/results.json
+	wait
+	PORT=$((PORT + 2))
+}
+
+echo "== default mix, closed loop, 8 connections"
+run -c 8 -n 20000
+echo "== metadata heavy"
+run -c 8 -n 20000 -m mk=40,mkdir=10,ls=20,rm=30 -d uniform:0:5
+echo "== large writes"
+run -c 4 -n 5000 -m w=60,cat=40 -s exp:2000
+echo "== open loop, 2000 ops/s"
+run -c 8 -t 5 -r 2000
@@ -0,0 +1,69 @@
+#!/bin/bash
+
+# Kills one of two mirrors while files are being written, brings it back
+# and checks that the fs server resyncs it: once the server has gone down
+# the two images must be the same. With fs -w the writes reach the disks
+# in batches, so the mirror is also lost while a batch is being sent.
+
+make > /dev/null || exit 1
+mkdir -p fsraid1
+cd fsraid1
+PORT=${PORT:-5700}
+FS_PORT=$((PORT + 2))
+fail=0
+
+for m in 0 1; do
+	rm -f m$m
+	head -c $((64 * 256 * 256)) /dev/zero > m$m
+done
+../disk 64 256 0 m0 $PORT > disk0.log 2>&1 &
+D0=$!
+../disk 64 256 0 m1 $((PORT + 1)) > disk1.log 2>&1 &
+D1=$!
+sleep 0.2
+../fs -w 100 -m $PORT,$((PORT + 1)) $FS_PORT > fs.log 2>&1 &
+FS=$!
+sleep 0.5
+
+exec 3<>/dev/tcp/localhost/$FS_PORT
+request() {
+	echo "$1" >&3
+	read -r reply <&3
+}
+
+request "f"
+request "mk f0"
+data=$(head -c 3000 /dev/zero | tr '\0' x)
+for i in $(seq 1 200); do
+	# the mirror goes away in the middle of the writes
+	[ $i -eq 50 ] && kill -9 $D1 && wait $D1 2>/dev/null
+	request "w f$((i - 1)) 3000 $data$i"
+	request "mk f$i"
+done
+request "disks"
+case "$reply" in
+*$((PORT + 1)):down*) ;;
+*) echo "FAIL: the killed mirror is not down: $reply"; fail=1 ;;
+esac
+
+../disk 64 256 0 m1 $((PORT + 1)) > disk1.log 2>&1 &
+D1=$!
+# resync runs between requests
+for i in $(seq 1 100); do
+	sleep 0.1
+	request "disks"
+	case "$reply" in
+	*$((PORT + 1)):up*stale=0*) break ;;
+	esac
+done
+request "e"
+exec 3>&-
+wait $FS
+grep -q "$((PORT + 1)) rejoined" fs.log || { echo "FAIL: the mirror did not rejoin"; fail=1; }
+grep -q "$((PORT + 1)) is in sync" fs.log || { echo "FAIL: the mirror was not resynced"; fail=1; }
+kill $D0 $D1 2>/dev/null
+wait 2>/dev/null
+cmp -s m0 m1 || { echo "FAIL: the mirrors differ"; fail=1; }
+
+[ $fail -eq 0 ] && echo "PASS"
+exit $fail
@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include <ctype.h>
+#include <limits.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,52 +9,233 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <netdb.h>
 
 #undef DEBUG
 
 int NUM_SECTORS(void);
+int NUM_PAGES(void);
+int PAGE_SIZE(void);
+int CONTENT_BYTES(void);
+int FREELIST_FIRST(void);
 int FREELIST_NSEC(void);
+int ITABLE_FIRST(void);
+int ITABLE_SLOTS(void);
+int NUM_INODES(void);
+int INODE_PAGE(int page_num);
+int INODE_OFFSET(int page_num);
+int INODE_MAGIC_OFFSET(void);
+int INLINE_BYTES(void);
 int ROOT_PAGE_NUM(void);
 
 // You can set this value to the actual number of sectors
 static int s_num_sectors = 2560 * 1024;
 
+// A page is 1 << s_page_shift bytes, a whole number of 256 byte sectors.
+// Volumes formatted before the page size was configurable have no
+// superblock and keep their freemap from page 0.
+static int s_page_shift = 8;
+static int s_freelist_first = 0;
+static int s_features = 0;
+// pages of the inode table, 0 when every inode has a page of its own
+static int s_itable_pages = 0;
+
 int NUM_SECTORS() {
     return s_num_sectors;
 }
 
-int FREELIST_NSEC() {
-    return NUM_SECTORS() / 256;
+int NUM_PAGES() {
+    return s_num_sectors >> (s_page_shift - 8);
 }
 
-int ROOT_PAGE_NUM() {
-    return FREELIST_NSEC();
+int PAGE_SIZE() {
+    return 1 << s_page_shift;
+}
+
+// the last 4 bytes of a page hold the next page, or the inode magic
+int CONTENT_BYTES() {
+    return PAGE_SIZE() - 4;
+}
+
+int FREELIST_FIRST() {
+    return s_freelist_first;
+}
+
+int FREELIST_NSEC() {
+    return (NUM_PAGES() + PAGE_SIZE() - 1) / PAGE_SIZE();
 }
 
+enum { OK = 0, ERROR };
+
+enum { RESULT_EXIT, RESULT_DONE, RESULT_YES, RESULT_NO, RESULT_ELSE };
+
 enum {
-    CONTENT_BYTES_PER_PAGE = 252,
+    SECTOR_SHIFT = 8,
+    SECTOR_SIZE = 1 << SECTOR_SHIFT,
+    PAGE_SHIFT_MIN = 8,   // 256 bytes, the only size of legacy volumes
+    PAGE_SHIFT_MAX = 16,  // 64 KB
+    // page 0 of a volume formatted with a page size:
+    // [magic][shift][npage][features][snapshot table inode][inode table pages]
+    SUPER_MAGIC = 0x46535342,
+    SUPER_SNAPSHOTS = 16,
+    SUPER_ITABLE = 20,
+    // inodes keep their encoding at 8 and the bytes of their chain at 12;
+    // older versions left whatever the page held there
+    FEATURE_ENCODING = 1,
+    // a file that fits in the unused part of its inode page lives there and
+    // has firstpage 0
+    INODE_INLINE_OFFSET = 20,
+    // a file with a chain keeps the last page of it where inline content
+    // would be, so an append finds it without a walk
+    FEATURE_TAIL = 2,
+    INODE_TAIL_OFFSET = INODE_INLINE_OFFSET,
+    // inodes are packed in the slots of a table rather than given a page
+    // each: [type][filesize][encoding][stored][firstpage][lastpage][magic],
+    // the same offsets as in an inode page. They hold no content inline.
+    FEATURE_ITABLE = 4,
+    INODE_SLOT_BYTES = 28,
+    INODE_SLOT_MAGIC = 24,
+    // folders take new items at the end of their content and mark removed
+    // ones in place, see folder_close
+    FEATURE_FOLDER_LOG = 8,
+    FOLDER_DEAD_MIN = 64, // removed items a folder holds before it is compacted
     INODE_NUM = 10000,
+    RECLAIM_BATCH = 256,  // pages the reclaimer frees between requests
+    REPLY_IOV = 64,       // pages a cat reply hands to one writev
     INODE_MAGIC_NUMBER = 0xCAFE
 };
 
+// the inode table, when there is one, comes right after the freemap
+int ITABLE_FIRST() {
+    return FREELIST_FIRST() + FREELIST_NSEC();
+}
+
+int ITABLE_SLOTS() {
+    return PAGE_SIZE() / INODE_SLOT_BYTES;
+}
+
+int NUM_INODES() {
+    return s_itable_pages ? s_itable_pages * ITABLE_SLOTS() : NUM_PAGES();
+}
+
+// An inode is named by its page, or with an inode table by its number:
+// inode n is slot n % ITABLE_SLOTS() of table page n / ITABLE_SLOTS().
+// Slot 0 is never used, so no inode is 0.
+int INODE_PAGE(int page_num) {
+    return s_itable_pages ? ITABLE_FIRST() + page_num / ITABLE_SLOTS() : page_num;
+}
+
+int INODE_OFFSET(int page_num) {
+    return s_itable_pages ? page_num % ITABLE_SLOTS() * INODE_SLOT_BYTES : 0;
+}
+
+int INODE_MAGIC_OFFSET() {
+    return s_itable_pages ? INODE_SLOT_MAGIC : CONTENT_BYTES();
+}
+
+// bytes of content an inode holds itself, before it needs a chain
+int INLINE_BYTES() {
+    return s_itable_pages ? 0 : CONTENT_BYTES() - INODE_INLINE_OFFSET;
+}
+
+int ROOT_PAGE_NUM() {
+    return s_itable_pages ? 1 : FREELIST_FIRST() + FREELIST_NSEC();
+}
+
+// A compressed file stores [nextent][nextent + 1 offsets][extents], every
+// extent EXTENT_BYTES of the file compressed on its own, so a read at an
+// offset only decompresses the extents it covers.
+enum { ENCODING_RAW, ENCODING_LZ, EXTENT_BYTES = 16384 };
+
+enum { LZ_HASH_BITS = 12, LZ_MIN_MATCH = 4, LZ_MAX_OFFSET = 65535 };
+
+typedef struct {
+    int port;
+    int sock;
+    FILE *in;          // replies are read through a buffered stream
+    int nsector;       // capacity reported by instruction I
+    int num_sector;    // sectors per cylinder
+    int up;
+    int last_cylinder; // where our last request left the head
+    int queue;         // requests routed to the member in the current transfer
+    char *stale;       // mirrored pages the member missed while it was down
+    int nstale;
+    int resync_cursor;
+    time_t retry_at;
+    long long nread;
+    long long nwrite;
+    double busy_us;    // sum of request latencies
+    double max_us;
+} StorageMember;
+
+enum { STORAGE_RAID0, STORAGE_RAID1 };
+enum { ROUTE_QUEUE, ROUTE_SEEK };
+
+// With STORAGE_RAID0 the volume is striped over the disk servers in units of
+// stripe_unit pages. With STORAGE_RAID1 every member holds the whole volume,
+// writes go to every member that is up, and each read goes to one of them.
+// c caches every page that has been read or written; dirty pages are
+// written back by storage_sync.
 typedef struct {
     char *c;
+    char *state;
+    int ndirty;
+    int *dirty;
+    int mode;
+    int route;
+    int route_next; // the member storage_route tries first, so ties go round
+    int nmember;
+    StorageMember *members;
+    int stripe_unit;
 } Storage;
 
+enum { PAGE_ABSENT, PAGE_CLEAN, PAGE_DIRTY };
+
+enum {
+    STORAGE_MAX_RUN = 64,       // pages per request, at most max_transfer of disk.c
+    STORAGE_DEPTH = 32,         // outstanding requests per member
+    STORAGE_RESYNC_BATCH = 256, // pages copied to a rejoined member per tick
+    STORAGE_RETRY_SECONDS = 1
+};
+
+typedef struct {
+    int page;
+    int sector;
+    int count;
+    int member; // -1 for mirrored runs
+} StorageRun;
+
+typedef struct {
+    int run;
+    double sent_at;
+} StorageSlot;
+
 enum { INODE_FILE, INODE_FOLDER };
 
 typedef struct {
-    int page_num; // do not save
+    int page_num; // its page, or its number in the inode table; not saved
     int type;
     int filesize;
     int firstpage;
+    int lastpage; // 0 while unknown, always for inline files
+    int encoding;
+    int stored;   // bytes in the chain or inline, filesize when raw
+    // content written with fs -w that has no pages yet, filesize bytes;
+    // the fields above still describe what is stored
+    char *delayed;
 } Inode;
 
 struct FileSystem;
+struct Session;
 
 typedef struct {
     struct FileSystem *fs; // reference
@@ -61,41 +244,328 @@ typedef struct {
 
 #define AS_FILE(x) ((File *)(x))
 
+// What a path resolves to. A request walks its path once with fs_lookup
+// and hands this down rather than the path.
 typedef struct {
-    char cname[4096];
+    Inode *parent;     // the folder the last name is in, NULL when none
+    const char *cname; // the last name, within the path
+    Inode *inode;      // what the path names, NULL when nothing
+} Lookup;
+
+// On disk an item is [len][name][page]. The top byte of len holds the
+// child's inode type plus one so ls does not have to load every inode;
+// items written before the type was recorded have 0 there. On volumes
+// with FEATURE_FOLDER_LOG the items run to the end of the content, the
+// count in front is what the last whole write held, and a removed item
+// names page 0, the superblock, until the folder is compacted.
+enum { ITEM_TYPE_SHIFT = 24, ITEM_LEN_MASK = (1 << ITEM_TYPE_SHIFT) - 1, ITEM_TYPE_UNKNOWN = -1 };
+
+// In memory the names of a folder's items are kept one after another in
+// its name arena, each with a terminating 0, and an item holds where its
+// name is. Removing an item leaves its name in the arena until close.
+typedef struct {
+    int off;
+    int len;
+    unsigned int hash; // compared before the name
     int page_num;
+    int type;
+    int at; // where the item is in the content, -1 until it is written
 } FolderItem;
 
 typedef struct {
     File file;
     int nitem;
+    int item_cap;
     FolderItem *items;
+    char *names;
+    int names_len;
+    int names_cap;
+    int dirty; // only a modified folder is written back on close
+    int whole; // and written whole rather than as a log
+    int nsaved; // the leading items that are in the content
+    int ndead;  // removed items the content holds
+    // where the items removed since open are, to be marked on close
+    int nremoved;
+    int removed_cap;
+    int *removed;
 } Folder;
 
+// The folders one request looks names up in and adds to, each opened
+// once and written back once when the request is done, so making many
+// names in a folder costs one update of it
+typedef struct {
+    struct FileSystem *fs; // reference
+    int nfolder;
+    int folder_cap;
+    Folder **folders;
+} FolderBatch;
+
+// A file arriving through put. Its bytes go into new pages as they come
+// and are linked in order; the file takes the chain only once all have
+// come, so until then it reads as before.
+typedef struct {
+    int active;
+    int failed;  // the bytes are still taken, the reply is No
+    int size;
+    int left;    // bytes still to come
+    int first;   // chain received so far
+    int last;
+    int used;    // bytes in last
+    int near;    // the file's inode page, where the chain is placed
+    double at;   // when the request came, for stats and the trace
+    char *line;  // the request
+    char *content; // the bytes come so far, kept only for the trace
+} Upload;
+
+// The chain routines specialized for one page size, see fs_page.h
+typedef struct {
+    void (*read)(File *file, char *buf, int offset, int len);
+    int (*write)(File *file, const char *buf, int buflen);
+    int (*append)(File *file, const char *buf, int len);
+    int (*patch)(File *file, int offset, const char *buf, int len);
+    int (*tail)(File *file);
+    void (*send)(File *file, FILE *fp);
+    void (*receive)(struct FileSystem *fs, Upload *up, const char *buf, int n);
+} PageOps;
+
+// The freemap byte of a page counts the references to it, so identical
+// pages written with dedup on are stored once. A chain is written from its
+// tail, so two files share a page only when they also share everything
+// after it, and a release stops at the first page still referenced.
+enum { REFS_MAX = 255 };
+
+// Pages are handed out by cylinder group, the pages that lie on one
+// cylinder of every disk, so that an inode, its folder and its chain sit
+// on few cylinders. A page is free when refs counts nothing for it.
 typedef struct {
     struct FileSystem *fs; // reference
     int max_page_num;
-    int nslot;
-    int *slots;
+    int nfree;
+    int group_pages;
+    int ngroup;
+    int *group_free;  // free pages in each group
+    int rotor;        // the last page handed out
+    int reserved;     // free pages promised to delayed content
+    unsigned char *refs;
+    unsigned char *pins;  // the part of refs held by snapshots
+    // fingerprint index of the pages written with dedup on, a hash table
+    // chained through next; next is -2 for a page not in it
+    int nbucket;
+    int *buckets;
+    int *next;
+    unsigned int *hashes;
 } Freelist;
 
+// Taking a snapshot pins every page in use, a reference more in refs and
+// in pins, so nothing it sees is freed or reused. Chains are never written
+// in place, inode pages are: the first write to a pinned one copies it out
+// and the pins move to the copy. A snapshot reads a page through the
+// first copy made at or after its epoch, the live page when there is none.
+// The table, with the copies, and the pin bitmap of every snapshot live in
+// files of their own, the table's inode named by the superblock.
+enum { SNAPSHOT_NAME_MAX = 63 };
+
+typedef struct {
+    char name[SNAPSHOT_NAME_MAX + 1];
+    int epoch;
+    int bitmap; // inode of the pages it pins, a bit each
+} Snapshot;
+
+typedef struct {
+    int page;
+    int copy;
+    int epoch;  // of the newest snapshot when the copy was made
+} SnapshotCopy;
+
+typedef struct {
+    struct FileSystem *fs; // reference
+    int page;   // inode of the table, 0 before the first snapshot
+    int epoch;  // of the newest snapshot
+    int nsnap;
+    Snapshot *snaps;
+    int ncopy;
+    int copy_cap;
+    SnapshotCopy *copies;
+    // copies by page, a hash table chained through chain
+    int nbucket;
+    int *buckets;
+    int *chain;
+} SnapshotTable;
+
+// Latency histograms keep STATS_SUB linear buckets per power of two, so
+// every bucket is within 1/STATS_SUB of its value whatever the scale, and
+// recording a sample is a couple of shifts.
+enum { STATS_SUB = 8, STATS_NBUCKET = 40 * STATS_SUB, STATS_NCOMMAND = 27 };
+
+// the last one collects whatever process_request does not know
+static const char *stats_names[STATS_NCOMMAND] = {
+    "f", "mk", "mkdir", "rm", "cd", "rmdir", "ls", "cat", "r", "w", "i", "d", "a", "put",
+    "open", "close", "hr", "hw", "hi", "hd", "ha", "hstat", "stats", "disks", "snapshot", "e", "other"
+};
+
+typedef struct {
+    long long count;
+    long long errors;
+    double max_us;
+    long long buckets[STATS_NBUCKET];
+} StatsCommand;
+
+typedef struct {
+    StatsCommand commands[STATS_NCOMMAND];
+    long long bytes_read;
+    long long bytes_written;
+    long long pages_allocated;
+    long long pages_freed;
+    long long inode_hits;
+    long long inode_misses;
+    long long inode_evictions;
+    long long folder_opens;
+    long long folder_appends;     // folder writes that only added and marked items
+    long long folder_compactions; // and folders rewritten to drop removed ones
+    long long packed_bytes;  // file bytes written compressed
+    long long packed_stored; // and what they took
+    long long dedup_pages;   // data pages written with dedup on
+    long long dedup_hits;    // of which were already stored
+    long long snapshot_copies; // inode pages copied out for snapshots
+    long long delayed_writes;  // file writes kept in memory with fs -w
+    long long delayed_stores;  // and the times such content got pages
+    long long pages_reused;    // chain pages a rewrite wrote over in place
+    long long handle_hits;     // handle requests that found their inode directly
+    long long handle_resolves; // and those that had to resolve the path again
+} Stats;
+
 typedef struct FileSystem {
     Storage *stor;
+    Stats stats;
     Freelist *freelist;
+    int *itable_free; // free slots in each inode table page, NULL without one
     Inode *cur;
     int ninode;
     Inode *inodes[INODE_NUM];
+    // inodes of removed trees whose pages are still to be freed
+    int nreclaim;
+    int reclaim_cap;
+    int *reclaim;
+    // inodes of folders with enough removed items to be compacted
+    int ncompact;
+    int compact_cap;
+    int *compact;
+    int format_shift; // page size of a plain f
+    int format_itable; // volume bytes per inode of the table a plain f lays out, 0 for none
+    int compress;     // store file content LZ compressed
+    int dedup;        // store identical file pages once
+    SnapshotTable *snapshots;
+    // epoch of the snapshot the current request reads, 0 for the live tree;
+    // its inodes are loaded into views, apart from the cache, by the page
+    // the tree names them by, which may since be in use for something else
+    int view;
+    int nview;
+    int view_cap;
+    Inode **views;
+    int *view_pages;
+    // the session whose request runs, replies may skip its stream
+    struct Session *session;
+    // with fs -w file content is stored only once the oldest of it has
+    // waited delay_us, so the writes in between collapse into one
+    double delay_us;
+    double delayed_at;
+    int ndelayed;
+    int delayed_cap;
+    Inode **delayed;
+    // names removed so far; only a removal frees an inode page, so a
+    // handle that has seen every one still names its inode
+    long long removals;
+    // per inode, bumped when it is released, so a page kept by number
+    // between requests can be told from the inode that reuses it
+    unsigned int *inode_gen;
+    unsigned int gen;
+    // every session, so a folder one of them is in is not removed
+    struct Session **sessions;
+    int nsession;
 } FileSystem;
 
+enum { SESSION_NUM = 256, SESSION_BUFSIZE = 8192, SESSION_HANDLES = 64 };
+
+// A file opened by a session, kept by the page the tree names its inode
+// by. When a name has been removed since, or another snapshot is mounted,
+// the path is resolved again, so a handle follows its name rather than
+// the inode it was opened on.
+typedef struct {
+    int page;   // 0 for a free handle
+    int dir;    // the working directory path is relative to
+    unsigned int dir_gen; // its generation, which changes when it is removed
+    int view;
+    long long removals;
+    char *path;
+} Handle;
+
+// A client connection. Requests are newline terminated; the working
+// directory is kept as a page number because cached inodes can be evicted.
+typedef struct Session {
+    int id;
+    int sock;
+    FILE *fp;
+    int cur;
+    unsigned int cur_gen; // the generation of cur when it was kept
+    int view;          // the mounted snapshot, 0 for none
+    Upload upload;
+    Handle handles[SESSION_HANDLES];
+    long long nsent;
+    int len;
+    char buf[SESSION_BUFSIZE];
+} Session;
+
+// Request trace. The file starts with TRACE_MAGIC, then one record per
+// request: [delta_us 4][session 2][len 2][reply bytes 4][request len]
+// where delta_us is the arrival time since the previous record. A record
+// with len TRACE_CLOSED marks a session going away. A put has
+// TRACE_PAYLOAD set in len and its content follows: [size 4][size bytes].
+#define TRACE_MAGIC "FSTRACE2"
+enum { TRACE_HEADER = 12, TRACE_PAYLOAD = 0x8000, TRACE_CLOSED = 0xFFFF };
+
+typedef struct {
+    FILE *fp;
+    double last_us;
+    long long nrecord;
+} Trace;
+
 int util_readint(char *array, int offset);
 void util_writeint(char *array, int offset, int value);
 
-char storage_readchar(Storage *stor, int page_num, int offset);
-void storage_writechar(Storage *stor, int page_num, int offset, char value);
-int storage_readint(Storage *stor, int page_num, int offset);
-void storage_writeint(Storage *stor, int page_num, int offset, int value);
-void storage_readpage(Storage *stor, int page_num, char *buf);
-void storage_writepage(Storage *stor, int page_num, const char *buf);
+int util_writen(int fd, const char *buf, int n);
+int util_intcmp(const void *a, const void *b);
+double util_now_us(void);
+
+int storage_connect(int port);
+int storage_member_open(StorageMember *member);
+Storage* storage_open(const char *ports, int mode, int stripe_unit, int route);
+void storage_close(Storage **stor);
+void storage_member_fail(Storage *stor, int m);
+void storage_mark_stale(StorageMember *member, int page, int count);
+int storage_has_stale(StorageMember *member, int page, int count);
+void storage_map(Storage *stor, int page_num, int *member, int *sector);
+int storage_group_sectors(Storage *stor);
+int storage_route(Storage *stor, StorageRun *run);
+int storage_request(Storage *stor, int m, StorageRun *run, int write);
+int storage_reply(Storage *stor, int m, StorageRun *run, int write);
+void storage_abandon(Storage *stor, int m, StorageRun *runs, StorageSlot *slots, int first, int nslot, int write);
+void storage_transfer(Storage *stor, int *pages, int npage, int write, int only);
+void storage_prefetch(Storage *stor, int first, int n);
+void storage_sync(Storage *stor);
+void storage_resync(Storage *stor, int m);
+void storage_tick(Storage *stor);
+void storage_dump(Storage *stor, FILE *fp);
+char* storage_page(Storage *stor, int page_num);
+void storage_mark_dirty(Storage *stor, int page_num);
+char* storage_pages(Storage *stor, int first, int n);
+void storage_mark_dirty_pages(Storage *stor, int first, int n);
+
+int stats_command(const char *line);
+int stats_bucket(long long us);
+long long stats_bucket_us(int bucket);
+double stats_percentile(StatsCommand *command, double q);
+void stats_record(Stats *stats, const char *line, int result, double us);
+void stats_dump(Stats *stats, FILE *fp);
 
 Inode* inode_new(int page_num);
 void inode_free(Inode **inode);
@@ -104,47 +574,131 @@ void file_init(File *file, FileSystem *fs, Inode *inode);
 File* file_new(FileSystem *fs, Inode *inode);
 void file_free(File **file);
 void file_get_contents(File *file, char *buf);
-void file_put_contents(File *file, const char *buf, int buflen);
+int file_store(File *file, const char *buf, int buflen);
+int file_put_contents(File *file, const char *buf, int buflen);
+void file_flush(File *file);
+int file_append(File *file, const char *buf, int len);
+int file_patch(File *file, int offset, const char *buf, int len);
+int file_pread(File *file, char *buf, int offset, int len);
+void file_reply_range(File *file, int pos, int l, FILE *fp);
+int file_insert(File *file, int pos, int l, const char *data);
+int file_delete(File *file, int pos, int l);
 
+int lz_emit(unsigned char *dst, int o, int cap, const unsigned char *lit, int nlit, int offset, int len);
+int lz_compress(const char *in, int n, char *out, int cap);
+int lz_decompress(const char *in, int n, char *out, int cap);
+char* lz_pack(const char *buf, int buflen, int *packed_len);
+
+char* freelist_map(FileSystem *fs);
+void freelist_map_dirty(FileSystem *fs);
 Freelist* freelist_new(FileSystem *fs);
 int in_freelist(int sec, Freelist *freelist);
 void freelist_free(Freelist *freelist);
-int freelist_allocate(Freelist *freelist);
-void freelist_release(Freelist *freelist, int page_num);
+int freelist_room(Freelist *freelist);
+int freelist_scan(Freelist *freelist, int group, int from);
+int freelist_allocate(Freelist *freelist, int goal);
+int freelist_release(Freelist *freelist, int page_num);
+void freelist_unpin(Freelist *freelist, int page_num);
+
+unsigned int dedup_hash(const char *page, int n);
+int dedup_page(FileSystem *fs, char *image, int goal);
+void dedup_forget(Freelist *freelist, int page_num);
+
+SnapshotTable* snapshot_table_new(FileSystem *fs);
+void snapshot_table_free(SnapshotTable **table, int save);
+void snapshot_index(SnapshotTable *table);
+void snapshot_add_copy(SnapshotTable *table, int page_num, int copy, int epoch);
+int snapshot_translate(SnapshotTable *table, int epoch, int page_num);
+Snapshot* snapshot_find(SnapshotTable *table, const char *name);
+void snapshot_cow(FileSystem *fs, int page_num);
+int snapshot_new_file(FileSystem *fs);
+int snapshot_write(FileSystem *fs, int page_num, const char *buf, int len);
+char* snapshot_read(FileSystem *fs, int page_num, int *len);
+void snapshot_drop_file(FileSystem *fs, int page_num);
+void snapshot_unmark(FileSystem *fs, unsigned char *bits, int page_num);
+int snapshot_save(FileSystem *fs);
+int snapshot_create(FileSystem *fs, const char *name);
+int snapshot_delete(FileSystem *fs, const char *name);
+void snapshot_list(FileSystem *fs, FILE *fp);
 
 Folder* folder_open(FileSystem *fs, Inode *inode);
 void folder_close(Folder **folder);
+int folder_log(Folder *folder);
+const char* folder_item_name(Folder *folder, FolderItem *item);
+int folder_find(Folder *folder, const char *cname);
 int folder_get_child(Folder *folder, const char *cname);
-void folder_add_child(Folder *folder, const char *cname, int page_num);
+void folder_add_child(Folder *folder, const char *cname, int page_num, int type);
 void folder_remove_child(Folder *folder, const char *cname);
+void folder_batch_init(FolderBatch *batch, FileSystem *fs);
+Folder* folder_batch_open(FolderBatch *batch, Inode *inode);
+void folder_batch_close(FolderBatch *batch);
 Inode* folder_lookup(FileSystem *fs, Inode *folder_inode, const char *path);
 int skip_folder_item(const char *s);
-void sort_strings(char **a, int n);
-void folder_dump(FileSystem *fs, Inode *folder_inode, FILE *outfile);
+int folder_item_cmp(const void *a, const void *b, void *names);
+void folder_dump(FileSystem *fs, Inode *folder_inode, FILE *outfile, int offset, int count);
 
+char* fs_page(FileSystem *fs, int page_num);
+void fs_mark_dirty(FileSystem *fs, int page_num);
+int fs_readint(FileSystem *fs, int page_num, int offset);
+void fs_writeint(FileSystem *fs, int page_num, int offset, int value);
+int fs_mount(FileSystem *fs);
+void fs_itable_scan(FileSystem *fs);
+int fs_inode_allocate(FileSystem *fs, int goal);
+void fs_inode_release(FileSystem *fs, int page_num);
+unsigned int fs_inode_gen(FileSystem *fs, int page_num);
 Inode* fs_load_inode(FileSystem *fs, int page_num);
 void fs_save_inode(FileSystem *fs, Inode *inode);
-void fs_init(FileSystem *fs);
-FileSystem* fs_new(void);
+int fs_set_view(FileSystem *fs, int epoch);
+int fs_inode_page(FileSystem *fs, Inode *inode);
+void fs_delay(FileSystem *fs, Inode *inode);
+char* fs_undelay(FileSystem *fs, Inode *inode);
+void fs_flush(FileSystem *fs);
+void fs_init(FileSystem *fs, Storage *stor);
+FileSystem* fs_new(Storage *stor);
 void fs_free(FileSystem **fs);
-int fs_format(FileSystem *fs);
-int fs_exists(FileSystem *fs, const char *f);
-int fs_isfile(FileSystem *fs, const char *f);
-int fs_isdir(FileSystem *fs, const char *d);
-void fs_split_path(const char *path, char *ppath, char *cname);
-int fs_create(FileSystem *fs, const char *f);
-int fs_mkdir(FileSystem *fs, const char *d);
-int fs_unlink(FileSystem *fs, const char *f);
-int fs_chdir(FileSystem *fs, const char *path);
-int fs_rmdir(FileSystem *fs, const char *d);
-void fs_ls(FileSystem *fs, FILE *fp);
-void fs_cat(FileSystem *fs, const char *f, FILE *fp);
-int fs_write(FileSystem *fs, const char *f, int l, const char *data);
-int fs_insert(FileSystem *fs, const char *f, int pos, int l, const char *data);
-int fs_delete(FileSystem *fs, const char *f, int pos, int l);
+int fs_format(FileSystem *fs, int page_shift, int inode_bytes);
+Inode* fs_lookup(FileSystem *fs, const char *path, Lookup *lookup);
+Inode* fs_lookup_file(FileSystem *fs, const char *path);
+int fs_make(FileSystem *fs, FolderBatch *batch, const char *path, int type, int parents);
+int fs_create(FileSystem *fs, FolderBatch *batch, Inode *parent, const char *cname);
+int fs_mkdir(FileSystem *fs, FolderBatch *batch, Inode *parent, const char *cname);
+int fs_unlink(FileSystem *fs, Lookup *lookup);
+int fs_chdir(FileSystem *fs, Inode *inode);
+int fs_within(FileSystem *fs, int page_num, int folder);
+int fs_rmdir(FileSystem *fs, Lookup *lookup);
+void fs_reclaim_push(FileSystem *fs, int page_num);
+int fs_reclaim(FileSystem *fs, int budget);
+void fs_compact_push(FileSystem *fs, int page_num);
+int fs_compact(FileSystem *fs);
+void fs_ls(FileSystem *fs, FILE *fp, int offset, int count);
+void fs_reply(FileSystem *fs, FILE *fp, struct iovec *iov, int n);
+void fs_cat(FileSystem *fs, Inode *inode, FILE *fp);
+void fs_pread(FileSystem *fs, Inode *inode, int pos, int l, FILE *fp);
+int fs_write(FileSystem *fs, Inode *inode, int l, const char *data);
+int fs_insert(FileSystem *fs, Inode *inode, int pos, int l, const char *data);
+int fs_append(FileSystem *fs, Inode *inode, int l, const char *data);
+int fs_delete(FileSystem *fs, Inode *inode, int pos, int l);
+void fs_put_begin(FileSystem *fs, const char *f, int size, const char *line);
+int fs_put_end(FileSystem *fs, Upload *up);
+void fs_put_drop(FileSystem *fs, Upload *up);
+int fs_open(FileSystem *fs, const char *f);
+int fs_close(FileSystem *fs, int h);
+Inode* fs_handle(FileSystem *fs, int h);
 
 int process_request(const char *line, FILE *fp, FileSystem *fs);
 
+Session* session_new(int id, int sock, FileSystem *fs);
+void session_free(Session **session);
+ssize_t session_write(void *cookie, const char *buf, size_t n);
+int session_writev(Session *session, struct iovec *iov, int n);
+int session_close(void *cookie);
+void session_receive(Session *session, FileSystem *fs, Trace *trace);
+int session_serve(Session *session, FileSystem *fs, Trace *trace);
+
+Trace* trace_open(const char *path);
+void trace_free(Trace **trace);
+void trace_record(Trace *trace, int id, double at, const char *line, int len, int nreply, const char *payload, int npayload);
+
 int util_readint(char *array, int offset) {
     union {
         char c[4];
@@ -167,289 +721,1960 @@ void util_writeint(char *array, int offset, int value) {
     for (i = 0; i < 4; i++) array[offset + i] = buf.c[i];
 }
 
-char storage_readchar(Storage *stor, int page_num, int offset) {
-    return stor->c[page_num * 256 + offset];
-}
-
-void storage_writechar(Storage *stor, int page_num, int offset, char value) {
-    stor->c[page_num * 256 + offset] = value;
+int util_writen(int fd, const char *buf, int n) {
+    int done = 0;
+    int k = 0;
+    
+    while (done < n) {
+        k = write(fd, buf + done, n - done);
+        if (k <= 0) return -1;
+        done += k;
+    }
+    return done;
 }
 
-int storage_readint(Storage *stor, int page_num, int offset) {
-    return util_readint(stor->c, page_num * 256 + offset);
+int util_intcmp(const void *a, const void *b) {
+    return *(const int *) a - *(const int *) b;
 }
 
-void storage_writeint(Storage *stor, int page_num, int offset, int value) {
-    util_writeint(stor->c, page_num * 256 + offset, value);
+double util_now_us() {
+    struct timeval tv;
+    
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1e6 + tv.tv_usec;
 }
 
-void storage_readpage(Storage *stor, int page_num, char *buf) {
-    memcpy(buf, stor->c + page_num * 256, 256);
+int storage_connect(int port) {
+    int sock;
+    struct sockaddr_in name;
+    struct hostent *host;
+    int one = 1;
+    
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        fprintf(stderr, "Socket error\n");
+        return -1;
+    }
+    name.sin_family = AF_INET;
+    host = gethostbyname("localhost");
+    name.sin_port = htons(port);
+    memcpy(&name.sin_addr.s_addr, host->h_addr, host->h_length);
+    if (connect(sock, (struct sockaddr *)&name, sizeof(name)) == -1) {
+        close(sock);
+        return -1;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
 }
 
-void storage_writepage(Storage *stor, int page_num, const char *buf) {
-    memcpy(stor->c + page_num * 256, buf, 256);
+int storage_member_open(StorageMember *member) {
+    int num_cylinder = 0;
+    char line[64] = "";
+    
+    member->sock = storage_connect(member->port);
+    if (member->sock < 0) return ERROR;
+    member->in = fdopen(dup(member->sock), "r");
+    if (util_writen(member->sock, "I\n", 2) < 0 || !fgets(line, sizeof(line), member->in)
+            || sscanf(line, "%d %d", &num_cylinder, &member->num_sector) != 2) {
+        fclose(member->in);
+        close(member->sock);
+        return ERROR;
+    }
+    member->nsector = num_cylinder * member->num_sector;
+    member->last_cylinder = 0;
+    member->up = 1;
+    return OK;
 }
 
-Inode* inode_new(int page_num) {
-    Inode *inode = NULL;
+// ports is a comma separated list of disk server ports
+Storage* storage_open(const char *ports, int mode, int stripe_unit, int route) {
+    Storage *stor = NULL;
+    const char *p = NULL;
+    int i = 0;
+    int min_nsector = 0;
     
-    inode = (Inode *) malloc(sizeof(Inode));
-    inode->page_num = page_num;
-    return inode;
+    stor = (Storage *) malloc(sizeof(Storage));
+    stor->mode = mode;
+    stor->route = route;
+    stor->route_next = 0;
+    stor->stripe_unit = mode == STORAGE_RAID0 ? stripe_unit : 1;
+    stor->nmember = 1;
+    for (p = ports; *p; ++p) {
+        if (*p == ',') stor->nmember++;
+    }
+    stor->members = (StorageMember *) calloc(stor->nmember, sizeof(StorageMember));
+    for (i = 0, p = ports; i < stor->nmember; ++i) {
+        StorageMember *member = &stor->members[i];
+        
+        member->port = atoi(p);
+        if (storage_member_open(member) != OK) {
+            fprintf(stderr, "Cannot connect to the disk on port %d\n", member->port);
+            exit(1);
+        }
+        if (i == 0 || member->nsector < min_nsector) min_nsector = member->nsector;
+        printf("Connection with the disk on port %d is established!\n", member->port);
+        p = strchr(p, ',') + 1;
+    }
+    // only whole stripe units are used, and the volume covers whole freelist
+    // pages, which also makes it whole pages of the largest size
+    if (mode == STORAGE_RAID0) {
+        s_num_sectors = min_nsector / stripe_unit * stripe_unit * stor->nmember / SECTOR_SIZE * SECTOR_SIZE;
+    } else {
+        s_num_sectors = min_nsector / SECTOR_SIZE * SECTOR_SIZE;
+    }
+    if (s_num_sectors == 0) {
+        fprintf(stderr, "The disks are too small for a volume, it needs at least %d sectors%s\n",
+                SECTOR_SIZE, mode == STORAGE_RAID0 && stor->nmember > 1 ? " in whole stripe units" : "");
+        exit(1);
+    }
+    stor->c = (char *) malloc(sizeof(char) * NUM_SECTORS() * SECTOR_SIZE);
+    stor->state = (char *) calloc(NUM_SECTORS(), sizeof(char));
+    stor->dirty = (int *) malloc(sizeof(int) * NUM_SECTORS());
+    stor->ndirty = 0;
+    return stor;
 }
 
-void inode_free(Inode **inode) {
-    if (inode && *inode) {
-        free(*inode);
-        *inode = NULL;
+void storage_close(Storage **stor) {
+    if (stor && *stor) {
+        int i = 0;
+        
+        storage_sync(*stor);
+        storage_dump(*stor, stdout);
+        for (i = 0; i < (*stor)->nmember; ++i) {
+            StorageMember *member = &(*stor)->members[i];
+            
+            if (member->up) {
+                util_writen(member->sock, "E\n", 2);
+                fclose(member->in);
+                close(member->sock);
+            }
+            free(member->stale);
+        }
+        free((*stor)->members);
+        free((*stor)->c);
+        free((*stor)->state);
+        free((*stor)->dirty);
+        free(*stor);
+        *stor = NULL;
     }
 }
 
-Inode* fs_load_inode(FileSystem *fs, int page_num) {
+// Losing a striped member, or the last mirror, loses data
+void storage_member_fail(Storage *stor, int m) {
+    StorageMember *member = &stor->members[m];
     int i = 0;
-    Inode *inode = NULL;
-    int magic_number = 0;
     
-    for (i = 0; i < fs->ninode; ++i) {
-        if (fs->inodes[i]->page_num == page_num) {
-            return fs->inodes[i];
-        }
+    fprintf(stderr, "Disk on port %d is down\n", member->port);
+    fclose(member->in);
+    close(member->sock);
+    member->up = 0;
+    member->retry_at = time(NULL) + STORAGE_RETRY_SECONDS;
+    for (i = 0; i < stor->nmember; ++i) {
+        if (stor->members[i].up) break;
     }
-    magic_number = storage_readint(fs->stor, page_num, CONTENT_BYTES_PER_PAGE);
-    if (magic_number != INODE_MAGIC_NUMBER) {
-        return NULL;
+    if (stor->mode == STORAGE_RAID0 || i == stor->nmember) {
+        fprintf(stderr, "The volume is no longer available\n");
+        exit(1);
     }
-    if (fs->ninode == INODE_NUM) {
-        inode_free(&(fs->inodes[0]));
-        fs->ninode--;
-        for (i = 0; i < fs->ninode; ++i) {
-            fs->inodes[i] = fs->inodes[i + 1];
-        }
+    if (!member->stale) {
+        member->stale = (char *) calloc(NUM_SECTORS(), sizeof(char));
     }
-    fs->inodes[fs->ninode++] = inode = inode_new(page_num);
-    inode->type = storage_readint(fs->stor, page_num, 0);
-    inode->filesize = storage_readint(fs->stor, page_num, 4);
-    inode->firstpage = storage_readint(fs->stor, page_num, 16);
-    return inode;
 }
 
-void fs_save_inode(FileSystem *fs, Inode *inode) {
-    storage_writeint(fs->stor, inode->page_num, 0, inode->type);
-    storage_writeint(fs->stor, inode->page_num, 4, inode->filesize);
-    storage_writeint(fs->stor, inode->page_num, 16, inode->firstpage);
-    storage_writeint(fs->stor, inode->page_num, CONTENT_BYTES_PER_PAGE, INODE_MAGIC_NUMBER);
+void storage_mark_stale(StorageMember *member, int page, int count) {
+    int i = 0;
+    
+    for (i = page; i < page + count; ++i) {
+        if (!member->stale[i]) {
+            member->stale[i] = 1;
+            member->nstale++;
+        }
+    }
 }
 
-void file_init(File *file, FileSystem *fs, Inode *inode) {
-    file->fs = fs;
-    file->inode = inode;
+int storage_has_stale(StorageMember *member, int page, int count) {
+    int i = 0;
+    
+    if (!member->nstale) return 0;
+    for (i = page; i < page + count; ++i) {
+        if (member->stale[i]) return 1;
+    }
+    return 0;
 }
 
-File* file_new(FileSystem *fs, Inode *inode) {
-    File *file = NULL;
+void storage_map(Storage *stor, int page_num, int *member, int *sector) {
+    int unit = page_num / stor->stripe_unit;
     
-    file = (File *) malloc(sizeof(File));
-    file_init(file, fs, inode);
-    return file;
+    if (stor->mode == STORAGE_RAID1) {
+        *member = -1;
+        *sector = page_num;
+        return;
+    }
+    *member = unit % stor->nmember;
+    *sector = unit / stor->nmember * stor->stripe_unit + page_num % stor->stripe_unit;
 }
 
-void file_free(File **file) {
-    if (file && *file) {
-        free(*file);
-        *file = NULL;
+// Sectors of the volume that lie on one cylinder of every member: with
+// RAID0 a cylinder of each, striped, with RAID1 the one all members mirror
+int storage_group_sectors(Storage *stor) {
+    int num_sector = 0;
+    int m = 0;
+    
+    for (m = 0; m < stor->nmember; ++m) {
+        if (m == 0 || stor->members[m].num_sector < num_sector) num_sector = stor->members[m].num_sector;
     }
+    return stor->mode == STORAGE_RAID0 ? num_sector * stor->nmember : num_sector;
 }
 
-void file_get_contents(File *file, char *buf) {
-    int page = 0;
-    int left = 0;
-    int offset = 0;
+// Pick the mirror to read a run from: the one with the fewest requests
+// routed to it so far, or the one whose head is nearest the run. Members
+// that are down or have not caught up on the run are skipped. Of equal
+// ones the first after the last pick wins, so reads that find every
+// mirror idle, as single page misses do, still take turns.
+int storage_route(Storage *stor, StorageRun *run) {
+    int best = -1;
+    int best_cost = 0;
+    int k = 0;
     
-    page = file->inode->firstpage;
-    left = file->inode->filesize;
-    offset = 0;
-    while (page) {
-        char buffer[256];
+    for (k = 0; k < stor->nmember; ++k) {
+        int m = (stor->route_next + k) % stor->nmember;
+        StorageMember *member = &stor->members[m];
+        int cost = 0;
         
-        storage_readpage(file->fs->stor, page, buffer);
-        if (left <= CONTENT_BYTES_PER_PAGE) {
-            memcpy(buf + offset, buffer, left);
-            buf[offset + left] = 0;
-            offset += left;
-            left = 0;
+        if (!member->up || storage_has_stale(member, run->page, run->count)) continue;
+        if (stor->route == ROUTE_SEEK) {
+            cost = abs(run->sector / member->num_sector - member->last_cylinder) * STORAGE_DEPTH + member->queue;
         } else {
-            memcpy(buf + offset, buffer, CONTENT_BYTES_PER_PAGE);
-            offset += CONTENT_BYTES_PER_PAGE;
-            left -= CONTENT_BYTES_PER_PAGE;
+            cost = member->queue;
+        }
+        if (best < 0 || cost < best_cost) {
+            best = m;
+            best_cost = cost;
         }
-        page = util_readint(buffer, CONTENT_BYTES_PER_PAGE);
     }
+    if (best >= 0) stor->route_next = (best + 1) % stor->nmember;
+    return best;
 }
 
-void file_put_contents(File *file, const char *buf, int buflen) {
-    int page = 0;
-    int npage = 0;
-    int nextpage = 0;
-    int i = 0;
+int storage_request(Storage *stor, int m, StorageRun *run, int write) {
+    StorageMember *member = &stor->members[m];
+    char *buf = NULL;
+    int len = 0;
+    int result = 0;
     
-    page = file->inode->firstpage;
-    while (page) {
-        char buffer[256];
-        
-        storage_readpage(file->fs->stor, page, buffer);
-        freelist_release(file->fs->freelist, page);
-        page = util_readint(buffer, CONTENT_BYTES_PER_PAGE);
-    }
-    file->inode->firstpage = 0;
-    file->inode->filesize = buflen;
-    npage = ceil(1.0 * buflen / CONTENT_BYTES_PER_PAGE);
-#ifdef DEBUG
-    fprintf(stderr, "file_put_contents, npage=%d\n", npage);
-#endif
-    nextpage = 0;
-    for (i = npage - 1; i >= 0; --i) {
-        page = freelist_allocate(file->fs->freelist);
-        storage_writepage(file->fs->stor, page, buf + i * CONTENT_BYTES_PER_PAGE);
-        storage_writeint(file->fs->stor, page, CONTENT_BYTES_PER_PAGE, nextpage);
-        nextpage = page;
+    buf = (char *) malloc(32 + (write ? run->count * SECTOR_SIZE : 0));
+    len = sprintf(buf, "%s %d %d\n", write ? "w" : "r", run->sector, run->count);
+    if (write) {
+        memcpy(buf + len, stor->c + run->page * SECTOR_SIZE, run->count * SECTOR_SIZE);
+        len += run->count * SECTOR_SIZE;
     }
-    file->inode->firstpage = nextpage;
+    result = util_writen(member->sock, buf, len);
+    free(buf);
+    member->last_cylinder = (run->sector + run->count - 1) / member->num_sector;
+    return result < 0 ? ERROR : OK;
 }
 
-Freelist* freelist_new(FileSystem *fs) {
-    Freelist *freelist = NULL;
-    int sec = 0;
-    int islot = 0;
+int storage_reply(Storage *stor, int m, StorageRun *run, int write) {
+    StorageMember *member = &stor->members[m];
+    char line[64] = "";
+    int i = 0;
     
-    freelist = (Freelist *) malloc(sizeof(Freelist));
-    freelist->fs = fs;
-    freelist->max_page_num = -1;
-    freelist->nslot = 0;
-    for (sec = 0; sec < NUM_SECTORS(); ++sec) {
-        if (storage_readchar(fs->stor, sec / 256, sec % 256)) {
-            freelist->max_page_num = sec;
-        } else {
-            freelist->nslot++;
-        }
+    if (!fgets(line, sizeof(line), member->in) || strncmp(line, "Yes", 3)) {
+        return ERROR;
     }
-    freelist->slots = (int *) malloc(sizeof(int) * (freelist->nslot + 1));
-    for (sec = 0; sec < NUM_SECTORS(); ++sec) {
-        if (!storage_readchar(fs->stor, sec / 256, sec % 256)) {
-            freelist->slots[islot++] = sec;
+    if (!write && fread(stor->c + run->page * SECTOR_SIZE, SECTOR_SIZE, run->count, member->in) != (size_t) run->count) {
+        return ERROR;
+    }
+    if (write) {
+        member->nwrite++;
+        for (i = run->page; member->nstale && i < run->page + run->count; ++i) {
+            if (member->stale[i]) {
+                member->stale[i] = 0;
+                member->nstale--;
+            }
         }
+    } else {
+        member->nread++;
+        memset(stor->state + run->page, PAGE_CLEAN, run->count);
     }
-    return freelist;
+    return OK;
 }
 
-int in_freelist(int sec, Freelist *freelist) {
+// The member failed in a transfer: whatever it was sent from slot first on
+// is in doubt, the writes among it are marked stale for the resync, and
+// nothing more goes to it
+void storage_abandon(Storage *stor, int m, StorageRun *runs, StorageSlot *slots, int first, int nslot, int write) {
     int i = 0;
     
-    for (i = 0; i < freelist->nslot; ++i)
-        if (sec == freelist->slots[i])
-            return 1;
-    return 0;
+    storage_member_fail(stor, m);
+    for (i = first; write && i < nslot; ++i) {
+        StorageRun *run = &runs[slots[i].run];
+        
+        storage_mark_stale(&stor->members[m], run->page, run->count);
+    }
 }
 
-void freelist_free(Freelist *freelist) {
-    if (freelist) {
-        int sec = 0;
+// pages must be sorted. Consecutive pages on the same member are merged
+// into one request, and requests to all members are in flight at the same
+// time, STORAGE_DEPTH at a time so neither side blocks on a full socket.
+// only restricts a transfer to one member, otherwise it is -1.
+void storage_transfer(Storage *stor, int *pages, int npage, int write, int only) {
+    StorageRun *runs = NULL;
+    StorageSlot *slots = NULL;
+    int nrun = 0;
+    int *nslot = NULL;
+    int *sent = NULL;
+    int *end = NULL;
+    int i = 0;
+    int m = 0;
+    int busy = 1;
+    int lost = 0;
+    
+    runs = (StorageRun *) malloc(sizeof(StorageRun) * npage);
+    for (i = 0; i < npage; ++i) {
+        StorageRun *run = runs + nrun - 1;
+        int sector = 0;
         
-        for (sec = 0; sec < NUM_SECTORS(); ++sec) {
-            if (sec > freelist->max_page_num) {
-                storage_writechar(freelist->fs->stor, sec / 256, sec % 256, 0);
-            } else if (in_freelist(sec, freelist)) {
-                storage_writechar(freelist->fs->stor, sec / 256, sec % 256, 0);
-            } else {
-                storage_writechar(freelist->fs->stor, sec / 256, sec % 256, 1);
+        storage_map(stor, pages[i], &m, &sector);
+        if (nrun && run->member == m && run->page + run->count == pages[i]
+                && run->sector + run->count == sector && run->count < STORAGE_MAX_RUN) {
+            run->count++;
+        } else {
+            run = runs + nrun++;
+            run->page = pages[i];
+            run->sector = sector;
+            run->count = 1;
+            run->member = m;
+        }
+    }
+    slots = (StorageSlot *) malloc(sizeof(StorageSlot) * stor->nmember * nrun);
+    nslot = (int *) calloc(stor->nmember, sizeof(int));
+    sent = (int *) calloc(stor->nmember, sizeof(int));
+    end = (int *) calloc(stor->nmember, sizeof(int));
+    for (m = 0; m < stor->nmember; ++m) stor->members[m].queue = 0;
+    for (i = 0; i < nrun; ++i) {
+        if (runs[i].member < 0 && !write) {
+            runs[i].member = only >= 0 ? only : storage_route(stor, &runs[i]);
+            if (runs[i].member >= 0) {
+                stor->members[runs[i].member].last_cylinder = runs[i].sector / stor->members[runs[i].member].num_sector;
             }
         }
-        free(freelist->slots);
-        free(freelist);
+        for (m = 0; m < stor->nmember; ++m) {
+            if (runs[i].member >= 0 && runs[i].member != m) continue;
+            if (only >= 0 && only != m) continue;
+            if (!stor->members[m].up) {
+                if (write) storage_mark_stale(&stor->members[m], runs[i].page, runs[i].count);
+                continue;
+            }
+            slots[m * nrun + nslot[m]++].run = i;
+            stor->members[m].queue++;
+        }
+    }
+    while (busy) {
+        busy = 0;
+        for (m = 0; m < stor->nmember; ++m) {
+            end[m] = sent[m] + STORAGE_DEPTH < nslot[m] ? sent[m] + STORAGE_DEPTH : nslot[m];
+            for (i = sent[m]; i < end[m]; ++i) {
+                StorageSlot *slot = &slots[m * nrun + i];
+                
+                slot->sent_at = util_now_us();
+                if (storage_request(stor, m, &runs[slot->run], write) != OK) break;
+            }
+            if (i < end[m]) {
+                // a send failed, as when the member has gone away
+                storage_abandon(stor, m, runs, slots + m * nrun, sent[m], nslot[m], write);
+                nslot[m] = end[m] = sent[m];
+                lost = 1;
+            }
+        }
+        for (m = 0; m < stor->nmember; ++m) {
+            for (i = sent[m]; i < end[m]; ++i) {
+                StorageSlot *slot = &slots[m * nrun + i];
+                double latency = 0;
+                
+                if (storage_reply(stor, m, &runs[slot->run], write) != OK) break;
+                latency = util_now_us() - slot->sent_at;
+                stor->members[m].busy_us += latency;
+                if (latency > stor->members[m].max_us) stor->members[m].max_us = latency;
+                busy = 1;
+            }
+            if (i < end[m]) {
+                storage_abandon(stor, m, runs, slots + m * nrun, sent[m], nslot[m], write);
+                nslot[m] = end[m] = sent[m];
+                lost = 1;
+            }
+            sent[m] = end[m];
+        }
+    }
+    free(runs);
+    free(slots);
+    free(nslot);
+    free(sent);
+    free(end);
+    // reads that went to a failed mirror are retried on the others
+    if (lost && !write && only < 0) {
+        int nleft = 0;
+        
+        for (i = 0; i < npage; ++i) {
+            if (stor->state[pages[i]] == PAGE_ABSENT) pages[nleft++] = pages[i];
+        }
+        if (nleft) storage_transfer(stor, pages, nleft, 0, -1);
     }
 }
 
-int freelist_allocate(Freelist *freelist) {
-    int page_num = -1;
+// Read every absent page in [first, first + n)
+void storage_prefetch(Storage *stor, int first, int n) {
+    int *pages = NULL;
+    int npage = 0;
+    int i = 0;
     
-    if (freelist->nslot > 0) {
-        page_num = freelist->slots[--(freelist->nslot)];
-    } else {
-        page_num = ++(freelist->max_page_num);
+    if (first + n > NUM_SECTORS()) n = NUM_SECTORS() - first;
+    pages = (int *) malloc(sizeof(int) * n);
+    for (i = first; i < first + n; ++i) {
+        if (stor->state[i] == PAGE_ABSENT) pages[npage++] = i;
     }
-#ifdef DEBUG
-    fprintf(stderr, "freelist allocate %d\n", page_num);
-#endif
-    return page_num;
+    if (npage) storage_transfer(stor, pages, npage, 0, -1);
+    free(pages);
 }
 
-void freelist_release(Freelist *freelist, int page_num) {
-    int *new_slots = NULL;
-    FileSystem *fs = NULL;
+void storage_sync(Storage *stor) {
     int i = 0;
     
-#ifdef DEBUG
-    fprintf(stderr, "freelist release %d\n", page_num);
-#endif
-    new_slots = (int *) malloc(sizeof(int) * (freelist->nslot + 1));
-    memcpy(new_slots, freelist->slots, sizeof(int) * freelist->nslot);
-    new_slots[freelist->nslot] = page_num;
-    free(freelist->slots);
-    freelist->slots = new_slots;
+    if (stor->ndirty) {
+        qsort(stor->dirty, stor->ndirty, sizeof(int), util_intcmp);
+        storage_transfer(stor, stor->dirty, stor->ndirty, 1, -1);
+        for (i = 0; i < stor->ndirty; ++i) stor->state[stor->dirty[i]] = PAGE_CLEAN;
+        stor->ndirty = 0;
+    }
+}
+
+// Copy up to STORAGE_RESYNC_BATCH pages the member missed from the others.
+// Dirty pages are left alone, the next storage_sync writes them everywhere.
+void storage_resync(Storage *stor, int m) {
+    StorageMember *member = &stor->members[m];
+    int pages[STORAGE_RESYNC_BATCH];
+    int npage = 0;
+    int nabsent = 0;
+    int scanned = 0;
+    int i = 0;
     
-    fs = freelist->fs;
-    for (i = 0; i < fs->ninode; ++i) {
-        if (fs->inodes[i]->page_num == page_num) {
-            break;
-        }
+    for (scanned = 0; scanned < NUM_SECTORS() && npage < STORAGE_RESYNC_BATCH; ++scanned) {
+        i = member->resync_cursor;
+        member->resync_cursor = (i + 1) % NUM_SECTORS();
+        if (member->stale[i] && stor->state[i] != PAGE_DIRTY) pages[npage++] = i;
     }
-    if (i < fs->ninode) {
-        fs->ninode--;
-        while (i < fs->ninode) {
-            fs->inodes[i] = fs->inodes[i + 1];
-            i++;
+    if (!npage) return;
+    qsort(pages, npage, sizeof(int), util_intcmp);
+    for (i = 0; i < npage; ++i) {
+        if (stor->state[pages[i]] == PAGE_ABSENT) nabsent++;
+    }
+    if (nabsent) {
+        int *absent = (int *) malloc(sizeof(int) * nabsent);
+        
+        for (i = 0, nabsent = 0; i < npage; ++i) {
+            if (stor->state[pages[i]] == PAGE_ABSENT) absent[nabsent++] = pages[i];
         }
+        storage_transfer(stor, absent, nabsent, 0, -1);
+        free(absent);
+    }
+    storage_transfer(stor, pages, npage, 1, m);
+    if (!member->nstale) {
+        printf("Disk on port %d is in sync\n", member->port);
     }
 }
 
-Folder* folder_open(FileSystem *fs, Inode *inode) {
-    Folder *folder = NULL;
-    char *buffer = NULL;
-    int offset = 0;
-    int i = 0;
+// Background work between requests: reconnect members that went down and
+// bring rejoined mirrors up to date, one batch at a time
+void storage_tick(Storage *stor) {
+    int m = 0;
     
-    folder = (Folder *) malloc(sizeof(Folder));
-    file_init(AS_FILE(folder), fs, inode);
-    buffer = (char *) malloc(inode->filesize);
-    file_get_contents(AS_FILE(folder), buffer);
-#ifdef DEBUG
-    fprintf(stderr, "folder_open buffer=");
-    for (i = 0; i < inode->filesize; ++i) fprintf(stderr, " %x", buffer[i]);
-    fprintf(stderr, "\n");
-#endif
-    folder->nitem = util_readint(buffer, 0);
-#ifdef DEBUG
-    fprintf(stderr, "folder_open, folder->nitem=%d\n", folder->nitem);
-#endif
-    folder->items = (FolderItem *) malloc(sizeof(FolderItem) * folder->nitem);
-    offset = 4;
-    for (i = 0; i < folder->nitem; ++i) {
-        int cname_len = 0;
+    for (m = 0; m < stor->nmember; ++m) {
+        StorageMember *member = &stor->members[m];
         
-        cname_len = util_readint(buffer, offset);
-        offset += 4;
-        memcpy(folder->items[i].cname, buffer + offset, cname_len);
-        folder->items[i].cname[cname_len] = 0;  // make it a string
-        offset += cname_len;
-        folder->items[i].page_num = util_readint(buffer, offset);
+        if (!member->up && time(NULL) >= member->retry_at) {
+            if (storage_member_open(member) == OK) {
+                printf("Disk on port %d rejoined, %d pages to resync\n", member->port, member->nstale);
+            } else {
+                member->retry_at = time(NULL) + STORAGE_RETRY_SECONDS;
+            }
+        }
+        if (member->up && member->nstale) {
+            storage_resync(stor, m);
+        }
+    }
+}
+
+void storage_dump(Storage *stor, FILE *fp) {
+    int m = 0;
+    
+    for (m = 0; m < stor->nmember; ++m) {
+        StorageMember *member = &stor->members[m];
+        long long nrequest = member->nread + member->nwrite;
+        
+        if (m) fprintf(fp, "; ");
+        fprintf(fp, "%d:%s reads=%lld writes=%lld avg_us=%.0f max_us=%.0f stale=%d",
+                member->port, member->up ? "up" : "down", member->nread, member->nwrite,
+                nrequest ? member->busy_us / nrequest : 0.0, member->max_us, member->nstale);
+    }
+    fprintf(fp, "\n");
+    fflush(fp);
+}
+
+// A miss reads the whole stripe around the page, one unit from every member
+char* storage_page(Storage *stor, int page_num) {
+    if (stor->state[page_num] == PAGE_ABSENT) {
+        int stripe = stor->stripe_unit * stor->nmember;
+        
+        storage_prefetch(stor, page_num / stripe * stripe, stripe);
+    }
+    return stor->c + page_num * SECTOR_SIZE;
+}
+
+void storage_mark_dirty(Storage *stor, int page_num) {
+    if (stor->state[page_num] != PAGE_DIRTY) {
+        stor->state[page_num] = PAGE_DIRTY;
+        stor->dirty[stor->ndirty++] = page_num;
+    }
+}
+
+// The storage pages [first, first + n), contiguous in the cache
+char* storage_pages(Storage *stor, int first, int n) {
+    int stripe = stor->stripe_unit * stor->nmember;
+    int i = 0;
+    
+    for (i = first; i < first + n; ++i) {
+        if (stor->state[i] == PAGE_ABSENT) {
+            int start = i / stripe * stripe;
+            
+            storage_prefetch(stor, start, (first + n - start + stripe - 1) / stripe * stripe);
+            break;
+        }
+    }
+    return stor->c + first * SECTOR_SIZE;
+}
+
+void storage_mark_dirty_pages(Storage *stor, int first, int n) {
+    int i = 0;
+    
+    for (i = first; i < first + n; ++i) {
+        storage_mark_dirty(stor, i);
+    }
+}
+
+int stats_command(const char *line) {
+    char command[16] = "";
+    int i = 0;
+    
+    sscanf(line, "%15s", command);
+    for (i = 0; i < STATS_NCOMMAND - 1; ++i) {
+        if (0 == strcmp(stats_names[i], command)) break;
+    }
+    return i;
+}
+
+int stats_bucket(long long us) {
+    int shift = 0;
+    int bucket = 0;
+    
+    if (us < STATS_SUB) return us < 0 ? 0 : (int) us;
+    while ((us >> shift) >= 2 * STATS_SUB) shift++;
+    bucket = (shift + 1) * STATS_SUB + (int) (us >> shift) - STATS_SUB;
+    return bucket < STATS_NBUCKET ? bucket : STATS_NBUCKET - 1;
+}
+
+// the smallest latency that falls into the bucket
+long long stats_bucket_us(int bucket) {
+    if (bucket < STATS_SUB) return bucket;
+    return (long long) (STATS_SUB + bucket % STATS_SUB) << (bucket / STATS_SUB - 1);
+}
+
+double stats_percentile(StatsCommand *command, double q) {
+    long long rank = 0;
+    long long seen = 0;
+    int i = 0;
+    
+    rank = (long long) ceil(q * command->count);
+    if (rank < 1) rank = 1;
+    for (i = 0; i < STATS_NBUCKET; ++i) {
+        seen += command->buckets[i];
+        if (seen >= rank) break;
+    }
+    if (i == STATS_NBUCKET) return command->max_us;
+    return stats_bucket_us(i) < command->max_us ? stats_bucket_us(i) : command->max_us;
+}
+
+void stats_record(Stats *stats, const char *line, int result, double us) {
+    StatsCommand *command = NULL;
+    
+    command = &stats->commands[stats_command(line)];
+    command->count++;
+    if (RESULT_NO == result) command->errors++;
+    if (us > command->max_us) command->max_us = us;
+    command->buckets[stats_bucket((long long) us)]++;
+}
+
+void stats_dump(Stats *stats, FILE *fp) {
+    int i = 0;
+    
+    for (i = 0; i < STATS_NCOMMAND; ++i) {
+        StatsCommand *command = &stats->commands[i];
+        
+        if (!command->count) continue;
+        fprintf(fp, "%s count=%lld errors=%lld p50_us=%.0f p99_us=%.0f p999_us=%.0f max_us=%.0f; ",
+                stats_names[i], command->count, command->errors, stats_percentile(command, 0.5),
+                stats_percentile(command, 0.99), stats_percentile(command, 0.999), command->max_us);
+    }
+    fprintf(fp, "bytes_read=%lld bytes_written=%lld pages_allocated=%lld pages_freed=%lld "
+            "inode_hits=%lld inode_misses=%lld inode_evictions=%lld folder_opens=%lld "
+            "packed_bytes=%lld packed_stored=%lld compress_ratio=%.2f "
+            "dedup_pages=%lld dedup_hits=%lld dedup_ratio=%.2f snapshot_copies=%lld "
+            "delayed_writes=%lld delayed_stores=%lld pages_reused=%lld "
+            "handle_hits=%lld handle_resolves=%lld folder_appends=%lld folder_compactions=%lld\n",
+            stats->bytes_read, stats->bytes_written, stats->pages_allocated, stats->pages_freed,
+            stats->inode_hits, stats->inode_misses, stats->inode_evictions, stats->folder_opens,
+            stats->packed_bytes, stats->packed_stored,
+            stats->packed_stored ? 1.0 * stats->packed_bytes / stats->packed_stored : 1.0,
+            stats->dedup_pages, stats->dedup_hits,
+            stats->dedup_hits ? 1.0 * stats->dedup_pages / (stats->dedup_pages - stats->dedup_hits) : 1.0,
+            stats->snapshot_copies, stats->delayed_writes, stats->delayed_stores, stats->pages_reused,
+            stats->handle_hits, stats->handle_resolves, stats->folder_appends, stats->folder_compactions);
+    fflush(fp);
+}
+
+Inode* inode_new(int page_num) {
+    Inode *inode = NULL;
+    
+    inode = (Inode *) calloc(1, sizeof(Inode));
+    inode->page_num = page_num;
+    return inode;
+}
+
+void inode_free(Inode **inode) {
+    if (inode && *inode) {
+        free((*inode)->delayed);
+        free(*inode);
+        *inode = NULL;
+    }
+}
+
+char* fs_page(FileSystem *fs, int page_num) {
+    return storage_pages(fs->stor, page_num << (s_page_shift - SECTOR_SHIFT), 1 << (s_page_shift - SECTOR_SHIFT));
+}
+
+void fs_mark_dirty(FileSystem *fs, int page_num) {
+    storage_mark_dirty_pages(fs->stor, page_num << (s_page_shift - SECTOR_SHIFT), 1 << (s_page_shift - SECTOR_SHIFT));
+}
+
+int fs_readint(FileSystem *fs, int page_num, int offset) {
+    return util_readint(fs_page(fs, page_num), offset);
+}
+
+void fs_writeint(FileSystem *fs, int page_num, int offset, int value) {
+    util_writeint(fs_page(fs, page_num), offset, value);
+    fs_mark_dirty(fs, page_num);
+}
+
+// Counts the free slots of every inode table page. The table is read as
+// one run, which leaves all of it in the storage cache.
+void fs_itable_scan(FileSystem *fs) {
+    int k = s_page_shift - SECTOR_SHIFT;
+    char *table = NULL;
+    int page = 0;
+    int slot = 0;
+    
+    free(fs->itable_free);
+    fs->itable_free = NULL;
+    if (!s_itable_pages) return;
+    fs->itable_free = (int *) calloc(s_itable_pages, sizeof(int));
+    table = storage_pages(fs->stor, ITABLE_FIRST() << k, s_itable_pages << k);
+    for (page = 0; page < s_itable_pages; ++page) {
+        for (slot = page ? 0 : 1; slot < ITABLE_SLOTS(); ++slot) {
+            int offset = (page << s_page_shift) + slot * INODE_SLOT_BYTES + INODE_SLOT_MAGIC;
+            
+            if (util_readint(table, offset) != INODE_MAGIC_NUMBER) fs->itable_free[page]++;
+        }
+    }
+}
+
+// Returns a free inode as near goal's as there is, or -1: a free page
+// without an inode table, else a free slot of the table page goal is in
+// or of the nearest one that has any. The caller saves the inode before
+// allocating another.
+int fs_inode_allocate(FileSystem *fs, int goal) {
+    char *page = NULL;
+    int t = 0;
+    int d = 0;
+    int slot = 0;
+    
+    if (!s_itable_pages) return freelist_allocate(fs->freelist, goal);
+    if (goal > 0 && goal < NUM_INODES()) t = goal / ITABLE_SLOTS();
+    for (d = 0; !fs->itable_free[t]; ++d) {
+        if (t + d >= s_itable_pages && t - d < 0) return -1;
+        if (t + d < s_itable_pages && fs->itable_free[t + d]) {
+            t += d;
+        } else if (t - d >= 0 && fs->itable_free[t - d]) {
+            t -= d;
+        }
+    }
+    page = fs_page(fs, ITABLE_FIRST() + t);
+    for (slot = t ? 0 : 1; util_readint(page, slot * INODE_SLOT_BYTES + INODE_SLOT_MAGIC) == INODE_MAGIC_NUMBER; ++slot);
+    fs->itable_free[t]--;
+    return t * ITABLE_SLOTS() + slot;
+}
+
+// Frees the inode's page, or its slot in the inode table. It stops being
+// an inode first, so a stale reference cannot load it.
+void fs_inode_release(FileSystem *fs, int page_num) {
+    int page = INODE_PAGE(page_num);
+    int i = 0;
+    
+    snapshot_cow(fs, page);
+    fs_writeint(fs, page, INODE_OFFSET(page_num) + INODE_MAGIC_OFFSET(), 0);
+    if (s_itable_pages) {
+        fs->itable_free[page - ITABLE_FIRST()]++;
+    } else {
+        freelist_release(fs->freelist, page);
+    }
+    fs->inode_gen[page_num] = ++fs->gen;
+    for (i = 0; i < fs->ninode; ++i) {
+        if (fs->inodes[i]->page_num == page_num) {
+            break;
+        }
+    }
+    if (i < fs->ninode) {
+        free(fs_undelay(fs, fs->inodes[i]));
+        inode_free(&(fs->inodes[i]));
+        fs->ninode--;
+        while (i < fs->ninode) {
+            fs->inodes[i] = fs->inodes[i + 1];
+            i++;
+        }
+    }
+}
+
+unsigned int fs_inode_gen(FileSystem *fs, int page_num) {
+    return page_num >= 0 && page_num < NUM_INODES() ? fs->inode_gen[page_num] : 0;
+}
+
+Inode* fs_load_inode(FileSystem *fs, int page_num) {
+    int i = 0;
+    Inode *inode = NULL;
+    char *base = NULL;
+    int page = 0;
+    int name = page_num;
+    
+    if (fs->view) {
+        // a snapshot's inodes stay out of the cache, which holds what the
+        // live tree has not saved yet
+        for (i = 0; i < fs->nview; ++i) {
+            if (fs->view_pages[i] == name) return fs->views[i];
+        }
+    }
+    for (i = 0; !fs->view && i < fs->ninode; ++i) {
+        if (fs->inodes[i]->page_num == page_num) {
+            // keep the cache in least-recently-used order so eviction never
+            // drops an inode the current request is still holding
+            inode = fs->inodes[i];
+            for (; i + 1 < fs->ninode; ++i) {
+                fs->inodes[i] = fs->inodes[i + 1];
+            }
+            fs->inodes[i] = inode;
+            fs->stats.inode_hits++;
+            return inode;
+        }
+    }
+    if (page_num < 0 || page_num >= NUM_INODES()) {
+        return NULL;
+    }
+    page = INODE_PAGE(page_num);
+    if (fs->view) {
+        page = snapshot_translate(fs->snapshots, fs->view, page);
+        // inline content is read through the page an inode is named by
+        if (!s_itable_pages) page_num = page;
+    }
+    base = fs_page(fs, page) + INODE_OFFSET(name);
+    if (util_readint(base, INODE_MAGIC_OFFSET()) != INODE_MAGIC_NUMBER) {
+        return NULL;
+    }
+    if (fs->view) {
+        if (fs->nview == fs->view_cap) {
+            fs->view_cap = fs->view_cap ? fs->view_cap * 2 : 64;
+            fs->views = (Inode **) realloc(fs->views, sizeof(Inode *) * fs->view_cap);
+            fs->view_pages = (int *) realloc(fs->view_pages, sizeof(int) * fs->view_cap);
+        }
+        fs->view_pages[fs->nview] = name;
+        inode = fs->views[fs->nview++] = inode_new(page_num);
+    } else if (fs->ninode == INODE_NUM) {
+        fs->stats.inode_evictions++;
+        fs_save_inode(fs, fs->inodes[0]);
+        inode_free(&(fs->inodes[0]));
+        fs->ninode--;
+        for (i = 0; i < fs->ninode; ++i) {
+            fs->inodes[i] = fs->inodes[i + 1];
+        }
+    }
+    if (!inode) {
+        fs->stats.inode_misses++;
+        fs->inodes[fs->ninode++] = inode = inode_new(page_num);
+    }
+    inode->type = util_readint(base, 0);
+    inode->filesize = util_readint(base, 4);
+    inode->firstpage = util_readint(base, 16);
+    inode->lastpage = 0;
+    if ((s_features & FEATURE_TAIL) && inode->firstpage) {
+        inode->lastpage = util_readint(base, INODE_TAIL_OFFSET);
+    }
+    inode->encoding = ENCODING_RAW;
+    inode->stored = inode->filesize;
+    if (s_features & FEATURE_ENCODING) {
+        inode->encoding = util_readint(base, 8);
+        inode->stored = util_readint(base, 12);
+    }
+    return inode;
+}
+
+// Delayed content is stored first, so the inode saved names its pages
+void fs_save_inode(FileSystem *fs, Inode *inode) {
+    char *page = NULL;
+    
+    if (inode->delayed) {
+        File file;
+        
+        file_init(&file, fs, inode);
+        file_flush(&file);
+    }
+    snapshot_cow(fs, INODE_PAGE(inode->page_num));
+    page = fs_page(fs, INODE_PAGE(inode->page_num)) + INODE_OFFSET(inode->page_num);
+    util_writeint(page, 0, inode->type);
+    util_writeint(page, 4, inode->filesize);
+    util_writeint(page, 16, inode->firstpage);
+    if (s_features & FEATURE_ENCODING) {
+        util_writeint(page, 8, inode->encoding);
+        util_writeint(page, 12, inode->stored);
+    }
+    if ((s_features & FEATURE_TAIL) && inode->firstpage) {
+        util_writeint(page, INODE_TAIL_OFFSET, inode->lastpage);
+    }
+    util_writeint(page, INODE_MAGIC_OFFSET(), INODE_MAGIC_NUMBER);
+    fs_mark_dirty(fs, INODE_PAGE(inode->page_num));
+}
+
+// Makes the requests that follow read the snapshot of epoch, or the live
+// tree for 0. ERROR when there is no such snapshot.
+int fs_set_view(FileSystem *fs, int epoch) {
+    int i = 0;
+    
+    for (i = 0; i < fs->nview; ++i) {
+        inode_free(&fs->views[i]);
+    }
+    fs->nview = 0;
+    fs->view = 0;
+    for (i = 0; epoch && i < fs->snapshots->nsnap; ++i) {
+        if (fs->snapshots->snaps[i].epoch == epoch) fs->view = epoch;
+    }
+    return fs->view == epoch ? OK : ERROR;
+}
+
+// The page the tree names the inode by
+int fs_inode_page(FileSystem *fs, Inode *inode) {
+    int i = 0;
+    
+    for (i = 0; fs->view && i < fs->nview; ++i) {
+        if (fs->views[i] == inode) return fs->view_pages[i];
+    }
+    return inode->page_num;
+}
+
+// Pages the content of a file takes, the ones it has to be promised
+// while it is delayed
+#define DELAY_PAGES(len) ((len) > INLINE_BYTES() ? ((len) + CONTENT_BYTES() - 1) / CONTENT_BYTES() : 0)
+
+// Puts the inode on the list fs_flush stores
+void fs_delay(FileSystem *fs, Inode *inode) {
+    if (!fs->ndelayed) fs->delayed_at = util_now_us();
+    if (fs->ndelayed == fs->delayed_cap) {
+        fs->delayed_cap = fs->delayed_cap ? fs->delayed_cap * 2 : 64;
+        fs->delayed = (Inode **) realloc(fs->delayed, sizeof(Inode *) * fs->delayed_cap);
+    }
+    fs->delayed[fs->ndelayed++] = inode;
+}
+
+// Takes the delayed content away from the inode, and the pages promised
+// for it, and returns it for the caller to free, or NULL. The caller
+// stores something else in its place or frees the inode.
+char* fs_undelay(FileSystem *fs, Inode *inode) {
+    char *buf = inode->delayed;
+    int i = 0;
+    
+    if (!buf) return NULL;
+    fs->freelist->reserved -= DELAY_PAGES(inode->filesize);
+    inode->delayed = NULL;
+    for (i = 0; i < fs->ndelayed && fs->delayed[i] != inode; ++i);
+    if (i < fs->ndelayed) fs->delayed[i] = fs->delayed[--fs->ndelayed];
+    return buf;
+}
+
+// Stores all delayed content and saves the inodes it belongs to
+void fs_flush(FileSystem *fs) {
+    while (fs->ndelayed) {
+        fs_save_inode(fs, fs->delayed[fs->ndelayed - 1]);
+    }
+}
+
+void file_init(File *file, FileSystem *fs, Inode *inode) {
+    file->fs = fs;
+    file->inode = inode;
+}
+
+File* file_new(FileSystem *fs, Inode *inode) {
+    File *file = NULL;
+    
+    file = (File *) malloc(sizeof(File));
+    file_init(file, fs, inode);
+    return file;
+}
+
+void file_free(File **file) {
+    if (file && *file) {
+        free(*file);
+        *file = NULL;
+    }
+}
+
+#define PAGE_FN_(name, shift) name##_##shift
+#define PAGE_FN_X(name, shift) PAGE_FN_(name, shift)
+#define PAGE_FN(name) PAGE_FN_X(name, PAGE_SHIFT)
+#define PAGE_SHIFT 8
+#include "fs_page.h"
+#define PAGE_SHIFT 9
+#include "fs_page.h"
+#define PAGE_SHIFT 10
+#include "fs_page.h"
+#define PAGE_SHIFT 11
+#include "fs_page.h"
+#define PAGE_SHIFT 12
+#include "fs_page.h"
+#define PAGE_SHIFT 13
+#include "fs_page.h"
+#define PAGE_SHIFT 14
+#include "fs_page.h"
+#define PAGE_SHIFT 15
+#include "fs_page.h"
+#define PAGE_SHIFT 16
+#include "fs_page.h"
+#undef PAGE_FN
+#undef PAGE_FN_X
+#undef PAGE_FN_
+
+// indexed by page shift - PAGE_SHIFT_MIN
+static const PageOps s_page_ops_table[] = {
+    { chain_read_8, chain_write_8, chain_append_8, chain_patch_8, chain_tail_8, chain_send_8, chain_receive_8 },
+    { chain_read_9, chain_write_9, chain_append_9, chain_patch_9, chain_tail_9, chain_send_9, chain_receive_9 },
+    { chain_read_10, chain_write_10, chain_append_10, chain_patch_10, chain_tail_10, chain_send_10, chain_receive_10 },
+    { chain_read_11, chain_write_11, chain_append_11, chain_patch_11, chain_tail_11, chain_send_11, chain_receive_11 },
+    { chain_read_12, chain_write_12, chain_append_12, chain_patch_12, chain_tail_12, chain_send_12, chain_receive_12 },
+    { chain_read_13, chain_write_13, chain_append_13, chain_patch_13, chain_tail_13, chain_send_13, chain_receive_13 },
+    { chain_read_14, chain_write_14, chain_append_14, chain_patch_14, chain_tail_14, chain_send_14, chain_receive_14 },
+    { chain_read_15, chain_write_15, chain_append_15, chain_patch_15, chain_tail_15, chain_send_15, chain_receive_15 },
+    { chain_read_16, chain_write_16, chain_append_16, chain_patch_16, chain_tail_16, chain_send_16, chain_receive_16 }
+};
+
+static const PageOps *s_page_ops = &s_page_ops_table[0];
+
+void file_get_contents(File *file, char *buf) {
+    file_pread(file, buf, 0, file->inode->filesize);
+    buf[file->inode->filesize] = 0;
+}
+
+// Gives the content pages now. Returns ERROR, leaving the file empty, when
+// the volume has no room.
+int file_store(File *file, const char *buf, int buflen) {
+    Inode *inode = file->inode;
+    char *packed = NULL;
+    int npacked = 0;
+    int result = OK;
+    
+    if (file->fs->compress && inode->type == INODE_FILE && (s_features & FEATURE_ENCODING)
+            && buflen > INLINE_BYTES()) {
+        packed = lz_pack(buf, buflen, &npacked);
+    }
+    if (packed) {
+        result = s_page_ops->write(file, packed, npacked);
+        inode->encoding = ENCODING_LZ;
+        inode->stored = npacked;
+        file->fs->stats.packed_bytes += buflen;
+        file->fs->stats.packed_stored += npacked;
+        free(packed);
+    } else {
+        result = s_page_ops->write(file, buf, buflen);
+        inode->encoding = ENCODING_RAW;
+        inode->stored = buflen;
+    }
+    inode->filesize = buflen;
+    if (result != OK) {
+        inode->encoding = ENCODING_RAW;
+        inode->filesize = inode->stored = 0;
+        return ERROR;
+    }
+    return OK;
+}
+
+// Returns ERROR, leaving the file empty, when the volume has no room. With
+// fs -w a file's content waits in memory for fs_flush, as long as the pages
+// it will take can be promised; a later write replaces it there. Emptying
+// a file gives its pages back at once.
+int file_put_contents(File *file, const char *buf, int buflen) {
+    FileSystem *fs = file->fs;
+    Inode *inode = file->inode;
+    int had = inode->delayed ? DELAY_PAGES(inode->filesize) : 0;
+    int need = DELAY_PAGES(buflen);
+    
+    if (fs->delay_us > 0 && inode->type == INODE_FILE && buflen && need - had <= freelist_room(fs->freelist)) {
+        if (!inode->delayed) fs_delay(fs, inode);
+        inode->delayed = (char *) realloc(inode->delayed, buflen + 1);
+        memcpy(inode->delayed, buf, buflen);
+        fs->freelist->reserved += need - had;
+        inode->filesize = buflen;
+        fs->stats.delayed_writes++;
+        fs->stats.bytes_written += buflen;
+        return OK;
+    }
+    free(fs_undelay(fs, inode));
+    if (file_store(file, buf, buflen) != OK) return ERROR;
+    fs->stats.bytes_written += buflen;
+    return OK;
+}
+
+// Stores the file's delayed content on the pages promised to it
+void file_flush(File *file) {
+    char *buf = fs_undelay(file->fs, file->inode);
+    
+    if (!buf) return;
+    file_store(file, buf, file->inode->filesize);
+    file->fs->stats.delayed_stores++;
+    free(buf);
+}
+
+// Adds buf after what the file holds. A raw file only has its last page
+// and the new ones written, unless that page is shared with other files
+// or snapshots; those and compressed files are rewritten whole.
+int file_append(File *file, const char *buf, int len) {
+    Inode *inode = file->inode;
+    Freelist *freelist = file->fs->freelist;
+    char *all = NULL;
+    int result = OK;
+    
+    if (len < 0) return ERROR;
+    if (!inode->delayed && inode->encoding == ENCODING_RAW && inode->firstpage && !inode->lastpage) {
+        inode->lastpage = s_page_ops->tail(file);
+    }
+    // delayed content is rewritten whole, in memory
+    if (!inode->delayed && inode->encoding == ENCODING_RAW
+            && (!inode->firstpage || freelist->refs[inode->lastpage] == 1)) {
+        // the last page no longer holds what dedup indexed it by
+        if (inode->firstpage) dedup_forget(freelist, inode->lastpage);
+        if (s_page_ops->append(file, buf, len) != OK) return ERROR;
+        inode->filesize = inode->stored = inode->filesize + len;
+        file->fs->stats.bytes_written += len;
+        return OK;
+    }
+    all = (char *) malloc(inode->filesize + len + 1);
+    file_get_contents(file, all);
+    memcpy(all + inode->filesize, buf, len);
+    result = file_put_contents(file, all, inode->filesize + len);
+    free(all);
+    return result;
+}
+
+// Writes len bytes over the file's content at offset, in place. Returns
+// ERROR, with nothing written, for content that is compressed, delayed or
+// shorter, or that shares a page it would write.
+int file_patch(File *file, int offset, const char *buf, int len) {
+    Inode *inode = file->inode;
+    
+    if (inode->delayed || inode->encoding != ENCODING_RAW || offset < 0 || offset + len > inode->filesize) {
+        return ERROR;
+    }
+    if (s_page_ops->patch(file, offset, buf, len) != OK) return ERROR;
+    file->fs->stats.bytes_written += len;
+    return OK;
+}
+
+// Reads up to len bytes at offset, returns how many there were
+int file_pread(File *file, char *buf, int offset, int len) {
+    Inode *inode = file->inode;
+    char *packed = NULL;
+    char *extent = NULL;
+    int e = 0;
+    
+    if (offset < 0 || offset > inode->filesize) offset = inode->filesize;
+    if (len < 0 || len > inode->filesize - offset) len = inode->filesize - offset;
+    file->fs->stats.bytes_read += len;
+    if (!len) return 0;
+    if (inode->delayed) {
+        memcpy(buf, inode->delayed + offset, len);
+        return len;
+    }
+    if (inode->encoding != ENCODING_LZ) {
+        s_page_ops->read(file, buf, offset, len);
+        return len;
+    }
+    extent = (char *) malloc(EXTENT_BYTES);
+    packed = (char *) malloc(EXTENT_BYTES + EXTENT_BYTES / 255 + 16);
+    for (e = offset / EXTENT_BYTES; e * EXTENT_BYTES < offset + len; ++e) {
+        char bounds[8];
+        int from = 0;
+        int to = 0;
+        int n = 0;
+        
+        s_page_ops->read(file, bounds, 4 + e * 4, 8);
+        n = util_readint(bounds, 4) - util_readint(bounds, 0);
+        if (n < 0 || n > EXTENT_BYTES + EXTENT_BYTES / 255 + 16) n = 0;
+        s_page_ops->read(file, packed, util_readint(bounds, 0), n);
+        if (lz_decompress(packed, n, extent, EXTENT_BYTES) < 0) memset(extent, 0, EXTENT_BYTES);
+        from = offset > e * EXTENT_BYTES ? offset - e * EXTENT_BYTES : 0;
+        to = offset + len < (e + 1) * EXTENT_BYTES ? offset + len - e * EXTENT_BYTES : EXTENT_BYTES;
+        memcpy(buf + e * EXTENT_BYTES + from - offset, extent + from, to - from);
+    }
+    free(packed);
+    free(extent);
+    return len;
+}
+
+// Replies [n]\n, the n bytes from pos on and \n, framed as fs_cat frames
+// a whole file; n is l or what is left, all that is left for l < 0
+void file_reply_range(File *file, int pos, int l, FILE *fp) {
+    struct iovec iov;
+    char *data = NULL;
+    int n = 0;
+    
+    if (l < 0 || l > file->inode->filesize) l = file->inode->filesize;
+    data = (char *) malloc(l + 1);
+    n = file_pread(file, data, pos, l);
+    fprintf(fp, "%d\n", n);
+    iov.iov_base = data;
+    iov.iov_len = n;
+    if (n) fs_reply(file->fs, fp, &iov, 1);
+    fprintf(fp, "\n");
+    fflush(fp);
+    free(data);
+}
+
+int file_insert(File *file, int pos, int l, const char *data) {
+    Inode *inode = file->inode;
+    char *buffer = NULL;
+    int i = 0;
+    int result = OK;
+    
+    if (l < 0) return ERROR;
+    buffer = (char *) malloc(inode->filesize + l + 1);
+    if (!buffer) return ERROR;
+    file_get_contents(file, buffer);
+    if (pos < 0 || pos > inode->filesize) {
+        pos = inode->filesize;
+    }
+    for (i = inode->filesize - 1; i >= pos; --i) {
+        buffer[i + l] = buffer[i];
+    }
+    memcpy(buffer + pos, data, l);
+    result = file_put_contents(file, buffer, inode->filesize + l);
+    free(buffer);
+    return result;
+}
+
+int file_delete(File *file, int pos, int l) {
+    Inode *inode = file->inode;
+    char *data = NULL;
+    int i = 0;
+    int result = OK;
+    
+    data = (char *) malloc(inode->filesize + 1);
+    if (!data) return ERROR;
+    file_get_contents(file, data);
+    if (pos < 0 || pos > inode->filesize) {
+        pos = inode->filesize;
+    }
+    if (l < 0 || pos + l > inode->filesize) {
+        l = inode->filesize - pos;
+    }
+    for (i = pos + l; i < inode->filesize; ++i) {
+        data[i - l] = data[i];
+    }
+    result = file_put_contents(file, data, inode->filesize - l);
+    free(data);
+    return result;
+}
+
+// LZ77 in the block format of LZ4: every sequence is a token, literals and
+// a match. The token holds the literal count in its high and the match
+// length minus LZ_MIN_MATCH in its low nibble, 15 meaning more length bytes
+// follow, each adding up to 255. The match is a 2 byte offset back into
+// what has been decoded. The last sequence has literals only.
+int lz_emit(unsigned char *dst, int o, int cap, const unsigned char *lit, int nlit, int offset, int len) {
+    int token = o;
+    int v = 0;
+    
+    if (o + 1 + nlit / 255 + 1 + nlit + 2 + len / 255 + 1 > cap) return -1;
+    dst[token] = (nlit < 15 ? nlit : 15) << 4;
+    o++;
+    if (nlit >= 15) {
+        for (v = nlit - 15; v >= 255; v -= 255) dst[o++] = 255;
+        dst[o++] = v;
+    }
+    memcpy(dst + o, lit, nlit);
+    o += nlit;
+    if (!len) return o;
+    dst[o++] = offset & 0xFF;
+    dst[o++] = offset >> 8;
+    len -= LZ_MIN_MATCH;
+    dst[token] |= len < 15 ? len : 15;
+    if (len >= 15) {
+        for (v = len - 15; v >= 255; v -= 255) dst[o++] = 255;
+        dst[o++] = v;
+    }
+    return o;
+}
+
+// Returns the compressed size, or -1 when it does not fit in cap
+int lz_compress(const char *in, int n, char *out, int cap) {
+    const unsigned char *src = (const unsigned char *) in;
+    unsigned char *dst = (unsigned char *) out;
+    int table[1 << LZ_HASH_BITS];
+    int anchor = 0;
+    int i = 0;
+    int o = 0;
+    
+    memset(table, -1, sizeof(table));
+    while (i + LZ_MIN_MATCH <= n) {
+        unsigned int seq = src[i] | src[i + 1] << 8 | src[i + 2] << 16 | (unsigned int) src[i + 3] << 24;
+        int h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int ref = table[h];
+        int len = LZ_MIN_MATCH;
+        
+        table[h] = i;
+        if (ref < 0 || i - ref > LZ_MAX_OFFSET || memcmp(src + ref, src + i, LZ_MIN_MATCH)) {
+            i++;
+            continue;
+        }
+        while (i + len < n && src[ref + len] == src[i + len]) len++;
+        if ((o = lz_emit(dst, o, cap, src + anchor, i - anchor, i - ref, len)) < 0) return -1;
+        i += len;
+        anchor = i;
+    }
+    return lz_emit(dst, o, cap, src + anchor, n - anchor, 0, 0);
+}
+
+// Returns the decompressed size, or -1 for a block that is not valid
+int lz_decompress(const char *in, int n, char *out, int cap) {
+    const unsigned char *src = (const unsigned char *) in;
+    unsigned char *dst = (unsigned char *) out;
+    int i = 0;
+    int o = 0;
+    
+    while (i < n) {
+        int token = src[i++];
+        int nlit = token >> 4;
+        int len = token & 15;
+        int offset = 0;
+        
+        if (nlit == 15) {
+            do {
+                if (i >= n) return -1;
+                nlit += src[i];
+            } while (src[i++] == 255);
+        }
+        if (i + nlit > n || o + nlit > cap) return -1;
+        memcpy(dst + o, src + i, nlit);
+        i += nlit;
+        o += nlit;
+        if (i == n) break;
+        if (i + 2 > n) return -1;
+        offset = src[i] | src[i + 1] << 8;
+        i += 2;
+        if (len == 15) {
+            do {
+                if (i >= n) return -1;
+                len += src[i];
+            } while (src[i++] == 255);
+        }
+        len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > o || o + len > cap) return -1;
+        // byte by byte, a match may overlap what it produces
+        for (; len > 0; --len, ++o) dst[o] = dst[o - offset];
+    }
+    return o;
+}
+
+// Compresses buf extent by extent into the layout file_pread reads.
+// Returns NULL when that would not save space.
+char* lz_pack(const char *buf, int buflen, int *packed_len) {
+    int nextent = (buflen + EXTENT_BYTES - 1) / EXTENT_BYTES;
+    int header = 4 + 4 * (nextent + 1);
+    char *packed = NULL;
+    int o = header;
+    int e = 0;
+    
+    if (header >= buflen) return NULL;
+    packed = (char *) malloc(buflen);
+    util_writeint(packed, 0, nextent);
+    for (e = 0; e < nextent; ++e) {
+        int n = buflen - e * EXTENT_BYTES < EXTENT_BYTES ? buflen - e * EXTENT_BYTES : EXTENT_BYTES;
+        int k = lz_compress(buf + e * EXTENT_BYTES, n, packed + o, buflen - o);
+        
+        if (k < 0) {
+            free(packed);
+            return NULL;
+        }
+        util_writeint(packed, 4 + e * 4, o);
+        o += k;
+    }
+    util_writeint(packed, 4 + nextent * 4, o);
+    *packed_len = o;
+    return packed;
+}
+
+// The freemap holds one byte per page in consecutive pages, so it is one
+// run of the storage cache
+char* freelist_map(FileSystem *fs) {
+    int k = s_page_shift - SECTOR_SHIFT;
+    
+    return storage_pages(fs->stor, FREELIST_FIRST() << k, FREELIST_NSEC() << k);
+}
+
+void freelist_map_dirty(FileSystem *fs) {
+    int k = s_page_shift - SECTOR_SHIFT;
+    
+    storage_mark_dirty_pages(fs->stor, FREELIST_FIRST() << k, FREELIST_NSEC() << k);
+}
+
+Freelist* freelist_new(FileSystem *fs) {
+    Freelist *freelist = NULL;
+    char *map = NULL;
+    int page = 0;
+    
+    freelist = (Freelist *) malloc(sizeof(Freelist));
+    freelist->fs = fs;
+    freelist->max_page_num = -1;
+    freelist->nfree = 0;
+    freelist->group_pages = storage_group_sectors(fs->stor) >> (s_page_shift - SECTOR_SHIFT);
+    if (freelist->group_pages < 1) freelist->group_pages = 1;
+    freelist->ngroup = (NUM_PAGES() + freelist->group_pages - 1) / freelist->group_pages;
+    freelist->group_free = (int *) calloc(freelist->ngroup, sizeof(int));
+    freelist->rotor = 0;
+    freelist->reserved = 0;
+    freelist->refs = (unsigned char *) malloc(NUM_PAGES());
+    freelist->pins = (unsigned char *) calloc(NUM_PAGES(), 1);
+    freelist->nbucket = 0;
+    freelist->buckets = NULL;
+    freelist->next = NULL;
+    freelist->hashes = NULL;
+    map = freelist_map(fs);
+    memcpy(freelist->refs, map, NUM_PAGES());
+    for (page = 0; page < NUM_PAGES(); ++page) {
+        if (map[page]) {
+            freelist->max_page_num = page;
+        } else {
+            freelist->nfree++;
+            freelist->group_free[page / freelist->group_pages]++;
+        }
+    }
+    return freelist;
+}
+
+int in_freelist(int sec, Freelist *freelist) {
+    return !freelist->refs[sec];
+}
+
+void freelist_free(Freelist *freelist) {
+    if (freelist) {
+        memcpy(freelist_map(freelist->fs), freelist->refs, NUM_PAGES());
+        freelist_map_dirty(freelist->fs);
+        free(freelist->group_free);
+        free(freelist->refs);
+        free(freelist->pins);
+        free(freelist->buckets);
+        free(freelist->next);
+        free(freelist->hashes);
+        free(freelist);
+    }
+}
+
+// Free pages not promised to delayed content
+int freelist_room(Freelist *freelist) {
+    return freelist->nfree - freelist->reserved;
+}
+
+// The first free page of the group from from on, wrapping around to the
+// start of the group, or -1
+int freelist_scan(Freelist *freelist, int group, int from) {
+    int first = group * freelist->group_pages;
+    int end = first + freelist->group_pages;
+    int page = 0;
+    
+    if (end > NUM_PAGES()) end = NUM_PAGES();
+    if (from < first || from >= end) from = first;
+    for (page = from; page < end; ++page) {
+        if (!freelist->refs[page]) return page;
+    }
+    for (page = first; page < from; ++page) {
+        if (!freelist->refs[page]) return page;
+    }
+    return -1;
+}
+
+// Returns a free page as near goal as there is, or -1 when the volume is
+// full: the next one after goal in its cylinder group, else one of the
+// nearest group that has any, looking both ways. With goal below 0 the
+// search starts after the page handed out last. Pages promised to delayed
+// content are not handed out for anything else.
+int freelist_allocate(Freelist *freelist, int goal) {
+    int page_num = -1;
+    int group = 0;
+    int d = 0;
+    
+    if (freelist_room(freelist) <= 0) return -1;
+    if (goal < 0 || goal >= NUM_PAGES()) goal = freelist->rotor;
+    group = goal / freelist->group_pages;
+    for (d = 0; page_num < 0; ++d) {
+        if (group + d < freelist->ngroup && freelist->group_free[group + d]) {
+            page_num = freelist_scan(freelist, group + d, d ? -1 : goal);
+        } else if (d && group - d >= 0 && freelist->group_free[group - d]) {
+            page_num = freelist_scan(freelist, group - d, -1);
+        }
+    }
+    freelist->nfree--;
+    freelist->group_free[page_num / freelist->group_pages]--;
+    freelist->rotor = page_num;
+    freelist->refs[page_num] = 1;
+    freelist->fs->stats.pages_allocated++;
+#ifdef DEBUG
+    fprintf(stderr, "freelist allocate %d\n", page_num);
+#endif
+    return page_num;
+}
+
+// Drops a reference to the page, returns 1 when it was the last one the
+// live tree held. The page is free again unless a snapshot pins it.
+int freelist_release(Freelist *freelist, int page_num) {
+    FileSystem *fs = NULL;
+    
+#ifdef DEBUG
+    fprintf(stderr, "freelist release %d\n", page_num);
+#endif
+    fs = freelist->fs;
+    if (freelist->refs[page_num] - freelist->pins[page_num] > 1) {
+        freelist->refs[page_num]--;
+        return 0;
+    }
+    if (!--freelist->refs[page_num]) {
+        dedup_forget(freelist, page_num);
+        freelist->nfree++;
+        freelist->group_free[page_num / freelist->group_pages]++;
+        fs->stats.pages_freed++;
+    }
+    return 1;
+}
+
+void freelist_unpin(Freelist *freelist, int page_num) {
+    if (!freelist->pins[page_num]) return;
+    freelist->pins[page_num]--;
+    if (--freelist->refs[page_num]) return;
+    dedup_forget(freelist, page_num);
+    freelist->nfree++;
+    freelist->group_free[page_num / freelist->group_pages]++;
+    freelist->fs->stats.pages_freed++;
+}
+
+// FNV-1a
+unsigned int dedup_hash(const char *page, int n) {
+    unsigned int h = 2166136261u;
+    int i = 0;
+    
+    for (i = 0; i < n; ++i) {
+        h = (h ^ (unsigned char) page[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Returns a page holding image, the one that already does with a reference
+// more if there is one, else a new one near goal, or -1 when the volume is
+// full. The caller holds a reference to the page image points to, a page
+// already holding image points there too and takes it over.
+int dedup_page(FileSystem *fs, char *image, int goal) {
+    Freelist *freelist = fs->freelist;
+    unsigned int h = dedup_hash(image, PAGE_SIZE());
+    int bucket = 0;
+    int page = 0;
+    
+    if (!freelist->buckets) {
+        for (freelist->nbucket = 1; freelist->nbucket < NUM_PAGES(); freelist->nbucket <<= 1);
+        freelist->buckets = (int *) malloc(sizeof(int) * freelist->nbucket);
+        memset(freelist->buckets, -1, sizeof(int) * freelist->nbucket);
+        freelist->next = (int *) malloc(sizeof(int) * NUM_PAGES());
+        for (page = 0; page < NUM_PAGES(); ++page) freelist->next[page] = -2;
+        freelist->hashes = (unsigned int *) malloc(sizeof(unsigned int) * NUM_PAGES());
+    }
+    fs->stats.dedup_pages++;
+    bucket = h & (freelist->nbucket - 1);
+    for (page = freelist->buckets[bucket]; page >= 0; page = freelist->next[page]) {
+        if (freelist->hashes[page] == h && freelist->refs[page] < REFS_MAX
+                && !memcmp(fs_page(fs, page), image, PAGE_SIZE())) {
+            int next = util_readint(image, CONTENT_BYTES());
+
+            freelist->refs[page]++;
+            if (next) freelist_release(freelist, next);
+            fs->stats.dedup_hits++;
+            return page;
+        }
+    }
+    if ((page = freelist_allocate(freelist, goal)) < 0) return -1;
+    memcpy(fs_page(fs, page), image, PAGE_SIZE());
+    fs_mark_dirty(fs, page);
+    freelist->hashes[page] = h;
+    freelist->next[page] = freelist->buckets[bucket];
+    freelist->buckets[bucket] = page;
+    return page;
+}
+
+void dedup_forget(Freelist *freelist, int page_num) {
+    int *link = NULL;
+    
+    if (!freelist->next || freelist->next[page_num] == -2) return;
+    link = &freelist->buckets[freelist->hashes[page_num] & (freelist->nbucket - 1)];
+    while (*link != page_num) link = &freelist->next[*link];
+    *link = freelist->next[page_num];
+    freelist->next[page_num] = -2;
+}
+
+SnapshotTable* snapshot_table_new(FileSystem *fs) {
+    SnapshotTable *table = NULL;
+    char *buf = NULL;
+    int len = 0;
+    int ncopy = 0;
+    int offset = 0;
+    int i = 0;
+    
+    table = (SnapshotTable *) calloc(1, sizeof(SnapshotTable));
+    table->fs = fs;
+    // volumes without a superblock have nowhere to name the table
+    if (!FREELIST_FIRST()) return table;
+    table->page = fs_readint(fs, 0, SUPER_SNAPSHOTS);
+    if (!table->page || !(buf = snapshot_read(fs, table->page, &len)) || len < 12) {
+        table->page = 0;
+        free(buf);
+        return table;
+    }
+    // [epoch][nsnap][ncopy], nsnap [epoch][bitmap][len][name], ncopy [page][copy][epoch]
+    table->epoch = util_readint(buf, 0);
+    table->nsnap = util_readint(buf, 4);
+    ncopy = util_readint(buf, 8);
+    table->snaps = (Snapshot *) calloc(table->nsnap + 1, sizeof(Snapshot));
+    offset = 12;
+    for (i = 0; i < table->nsnap; ++i) {
+        Snapshot *snap = &table->snaps[i];
+        int name_len = 0;
+        
+        snap->epoch = util_readint(buf, offset);
+        snap->bitmap = util_readint(buf, offset + 4);
+        name_len = util_readint(buf, offset + 8);
+        memcpy(snap->name, buf + offset + 12, name_len);
+        snap->name[name_len] = 0;
+        offset += 12 + name_len;
+    }
+    for (i = 0; i < ncopy; ++i, offset += 12) {
+        snapshot_add_copy(table, util_readint(buf, offset), util_readint(buf, offset + 4), util_readint(buf, offset + 8));
+    }
+    free(buf);
+    // the pins are not stored, every snapshot's bitmap gives them back
+    fs->snapshots = table;
+    for (i = 0; i < table->nsnap; ++i) {
+        unsigned char *bits = NULL;
+        int page = 0;
+        
+        if (!(bits = (unsigned char *) snapshot_read(fs, table->snaps[i].bitmap, &len))) continue;
+        for (page = 0; page < len * 8 && page < NUM_PAGES(); ++page) {
+            if (bits[page >> 3] & 1 << (page & 7)) {
+                fs->freelist->pins[snapshot_translate(table, table->snaps[i].epoch, page)]++;
+            }
+        }
+        free(bits);
+    }
+    return table;
+}
+
+void snapshot_table_free(SnapshotTable **table, int save) {
+    if (table && *table) {
+        if (save) snapshot_save((*table)->fs);
+        free((*table)->snaps);
+        free((*table)->copies);
+        free((*table)->buckets);
+        free((*table)->chain);
+        free(*table);
+        *table = NULL;
+    }
+}
+
+void snapshot_index(SnapshotTable *table) {
+    int i = 0;
+    
+    if (!table->buckets || table->nbucket < table->ncopy) {
+        for (table->nbucket = 1024; table->nbucket < table->ncopy; table->nbucket <<= 1);
+        table->buckets = (int *) realloc(table->buckets, sizeof(int) * table->nbucket);
+    }
+    memset(table->buckets, -1, sizeof(int) * table->nbucket);
+    for (i = 0; i < table->ncopy; ++i) {
+        int bucket = table->copies[i].page & (table->nbucket - 1);
+        
+        table->chain[i] = table->buckets[bucket];
+        table->buckets[bucket] = i;
+    }
+}
+
+void snapshot_add_copy(SnapshotTable *table, int page_num, int copy, int epoch) {
+    if (table->ncopy == table->copy_cap) {
+        table->copy_cap = table->copy_cap ? table->copy_cap * 2 : 1024;
+        table->copies = (SnapshotCopy *) realloc(table->copies, sizeof(SnapshotCopy) * table->copy_cap);
+        table->chain = (int *) realloc(table->chain, sizeof(int) * table->copy_cap);
+    }
+    table->copies[table->ncopy].page = page_num;
+    table->copies[table->ncopy].copy = copy;
+    table->copies[table->ncopy].epoch = epoch;
+    table->ncopy++;
+    if (table->ncopy > table->nbucket) {
+        snapshot_index(table);
+    } else {
+        int bucket = page_num & (table->nbucket - 1);
+        
+        table->chain[table->ncopy - 1] = table->buckets[bucket];
+        table->buckets[bucket] = table->ncopy - 1;
+    }
+}
+
+// The page the snapshot of epoch reads for page_num
+int snapshot_translate(SnapshotTable *table, int epoch, int page_num) {
+    int best = -1;
+    int i = 0;
+    
+    if (!table->ncopy) return page_num;
+    for (i = table->buckets[page_num & (table->nbucket - 1)]; i >= 0; i = table->chain[i]) {
+        SnapshotCopy *copy = &table->copies[i];
+        
+        if (copy->page == page_num && copy->epoch >= epoch && (best < 0 || copy->epoch < table->copies[best].epoch)) {
+            best = i;
+        }
+    }
+    return best < 0 ? page_num : table->copies[best].copy;
+}
+
+Snapshot* snapshot_find(SnapshotTable *table, const char *name) {
+    int i = 0;
+    
+    for (i = 0; i < table->nsnap; ++i) {
+        if (0 == strcmp(table->snaps[i].name, name)) return &table->snaps[i];
+    }
+    return NULL;
+}
+
+// Called before an inode page is written in place, copies out what the
+// snapshots pinning it still have to see
+void snapshot_cow(FileSystem *fs, int page_num) {
+    Freelist *freelist = fs->freelist;
+    int copy = 0;
+    
+    if (!freelist->pins[page_num]) return;
+    if ((copy = freelist_allocate(freelist, page_num)) < 0) {
+        fprintf(stderr, "No room to keep page %d for its snapshots\n", page_num);
+        return;
+    }
+    memcpy(fs_page(fs, copy), fs_page(fs, page_num), PAGE_SIZE());
+    fs_mark_dirty(fs, copy);
+    freelist->refs[copy] = freelist->pins[copy] = freelist->pins[page_num];
+    freelist->refs[page_num] -= freelist->pins[page_num];
+    freelist->pins[page_num] = 0;
+    snapshot_add_copy(fs->snapshots, page_num, copy, fs->snapshots->epoch);
+    fs->stats.snapshot_copies++;
+}
+
+// An empty file outside the tree, returns its inode or -1
+int snapshot_new_file(FileSystem *fs) {
+    Inode *inode = NULL;
+    int p = 0;
+    
+    if ((p = fs_inode_allocate(fs, -1)) < 0) return -1;
+    inode = inode_new(p);
+    inode->type = INODE_FILE;
+    fs_save_inode(fs, inode);
+    inode_free(&inode);
+    return p;
+}
+
+// Stores buf uncompressed, so fsck can read it
+int snapshot_write(FileSystem *fs, int page_num, const char *buf, int len) {
+    Inode *inode = fs_load_inode(fs, page_num);
+    File file;
+    
+    if (!inode) return ERROR;
+    file_init(&file, fs, inode);
+    inode->encoding = ENCODING_RAW;
+    inode->filesize = inode->stored = 0;
+    if (s_page_ops->write(&file, buf, len) == OK) {
+        inode->filesize = inode->stored = len;
+    }
+    fs_save_inode(fs, inode);
+    return inode->filesize == len ? OK : ERROR;
+}
+
+char* snapshot_read(FileSystem *fs, int page_num, int *len) {
+    Inode *inode = fs_load_inode(fs, page_num);
+    File file;
+    char *buf = NULL;
+    
+    if (!inode) return NULL;
+    file_init(&file, fs, inode);
+    buf = (char *) malloc(inode->filesize + 1);
+    file_get_contents(&file, buf);
+    *len = inode->filesize;
+    return buf;
+}
+
+void snapshot_drop_file(FileSystem *fs, int page_num) {
+    Inode *inode = fs_load_inode(fs, page_num);
+    File file;
+    
+    if (!inode) return;
+    file_init(&file, fs, inode);
+    file_put_contents(&file, "", 0);
+    fs_inode_release(fs, page_num);
+}
+
+// Leaves the pages of a snapshot file out of bits, those shared with the
+// tree stay in
+void snapshot_unmark(FileSystem *fs, unsigned char *bits, int page_num) {
+    Inode *inode = NULL;
+    int p = 0;
+    
+    if (!page_num || !(inode = fs_load_inode(fs, page_num))) return;
+    // an inode table page holds other inodes, which stay pinned
+    if (!s_itable_pages) bits[page_num >> 3] &= ~(1 << (page_num & 7));
+    for (p = inode->firstpage; p && fs->freelist->refs[p] == 1; p = fs_readint(fs, p, CONTENT_BYTES())) {
+        bits[p >> 3] &= ~(1 << (p & 7));
+    }
+}
+
+int snapshot_save(FileSystem *fs) {
+    SnapshotTable *table = fs->snapshots;
+    char *buf = NULL;
+    int len = 12;
+    int offset = 12;
+    int result = OK;
+    int i = 0;
+    
+    if (!table->page && !table->nsnap) return OK;
+    if (!table->page) {
+        if ((table->page = snapshot_new_file(fs)) < 0) {
+            table->page = 0;
+            return ERROR;
+        }
+        fs_writeint(fs, 0, SUPER_SNAPSHOTS, table->page);
+    }
+    for (i = 0; i < table->nsnap; ++i) len += 12 + strlen(table->snaps[i].name);
+    len += 12 * table->ncopy;
+    buf = (char *) malloc(len);
+    util_writeint(buf, 0, table->epoch);
+    util_writeint(buf, 4, table->nsnap);
+    util_writeint(buf, 8, table->ncopy);
+    for (i = 0; i < table->nsnap; ++i) {
+        int name_len = strlen(table->snaps[i].name);
+        
+        util_writeint(buf, offset, table->snaps[i].epoch);
+        util_writeint(buf, offset + 4, table->snaps[i].bitmap);
+        util_writeint(buf, offset + 8, name_len);
+        memcpy(buf + offset + 12, table->snaps[i].name, name_len);
+        offset += 12 + name_len;
+    }
+    for (i = 0; i < table->ncopy; ++i, offset += 12) {
+        util_writeint(buf, offset, table->copies[i].page);
+        util_writeint(buf, offset + 4, table->copies[i].copy);
+        util_writeint(buf, offset + 8, table->copies[i].epoch);
+    }
+    result = snapshot_write(fs, table->page, buf, len);
+    free(buf);
+    return result;
+}
+
+// Costs a pass over the freemap and writing the bitmap, no file content
+// is copied
+int snapshot_create(FileSystem *fs, const char *name) {
+    SnapshotTable *table = fs->snapshots;
+    Freelist *freelist = fs->freelist;
+    Snapshot *snap = NULL;
+    unsigned char *bits = NULL;
+    int nbyte = (NUM_PAGES() + 7) / 8;
+    int bitmap = 0;
+    int page = 0;
+    int i = 0;
+    
+    if (!FREELIST_FIRST() || !name[0] || strlen(name) > SNAPSHOT_NAME_MAX || snapshot_find(table, name)) {
+        return ERROR;
+    }
+    // what the snapshot sees has to be on its pages
+    for (i = 0; i < fs->ninode; ++i) {
+        fs_save_inode(fs, fs->inodes[i]);
+    }
+    bits = (unsigned char *) calloc(nbyte, 1);
+    for (page = ITABLE_FIRST(); page < NUM_PAGES(); ++page) {
+        if (!freelist->refs[page]) continue;
+        if (freelist->refs[page] == REFS_MAX) {
+            free(bits);
+            return ERROR;
+        }
+        bits[page >> 3] |= 1 << (page & 7);
+    }
+    snapshot_unmark(fs, bits, table->page);
+    for (i = 0; i < table->nsnap; ++i) {
+        snapshot_unmark(fs, bits, table->snaps[i].bitmap);
+    }
+    if ((bitmap = snapshot_new_file(fs)) < 0 || snapshot_write(fs, bitmap, (char *) bits, nbyte) != OK) {
+        if (bitmap >= 0) snapshot_drop_file(fs, bitmap);
+        free(bits);
+        return ERROR;
+    }
+    for (page = ITABLE_FIRST(); page < NUM_PAGES(); ++page) {
+        if (bits[page >> 3] & 1 << (page & 7)) {
+            freelist->refs[page]++;
+            freelist->pins[page]++;
+        }
+    }
+    free(bits);
+    table->snaps = (Snapshot *) realloc(table->snaps, sizeof(Snapshot) * (table->nsnap + 1));
+    snap = &table->snaps[table->nsnap++];
+    strcpy(snap->name, name);
+    snap->epoch = ++table->epoch;
+    snap->bitmap = bitmap;
+    return snapshot_save(fs);
+}
+
+int snapshot_delete(FileSystem *fs, const char *name) {
+    SnapshotTable *table = fs->snapshots;
+    Snapshot *snap = NULL;
+    unsigned char *bits = NULL;
+    int len = 0;
+    int page = 0;
+    int i = 0;
+    int n = 0;
+    
+    if (!(snap = snapshot_find(table, name))) return ERROR;
+    if ((bits = (unsigned char *) snapshot_read(fs, snap->bitmap, &len))) {
+        for (page = 0; page < len * 8 && page < NUM_PAGES(); ++page) {
+            if (bits[page >> 3] & 1 << (page & 7)) {
+                freelist_unpin(fs->freelist, snapshot_translate(table, snap->epoch, page));
+            }
+        }
+        free(bits);
+    }
+    snapshot_drop_file(fs, snap->bitmap);
+    table->nsnap--;
+    memmove(snap, snap + 1, sizeof(Snapshot) * (table->snaps + table->nsnap - snap));
+    // copies no snapshot reads any more went back to the free list
+    for (i = 0; i < table->ncopy; ++i) {
+        if (fs->freelist->refs[table->copies[i].copy]) table->copies[n++] = table->copies[i];
+    }
+    table->ncopy = n;
+    snapshot_index(table);
+    return snapshot_save(fs);
+}
+
+void snapshot_list(FileSystem *fs, FILE *fp) {
+    int i = 0;
+    
+    for (i = 0; i < fs->snapshots->nsnap; ++i) {
+        fprintf(fp, i ? " %s" : "%s", fs->snapshots->snaps[i].name);
+    }
+    fprintf(fp, "\n");
+    fflush(fp);
+}
+
+Folder* folder_open(FileSystem *fs, Inode *inode) {
+    Folder *folder = NULL;
+    char *buffer = NULL;
+    int nrecord = 0;
+    int offset = 0;
+    int i = 0;
+    
+    fs->stats.folder_opens++;
+    folder = (Folder *) malloc(sizeof(Folder));
+    file_init(AS_FILE(folder), fs, inode);
+    buffer = (char *) malloc(inode->filesize + 1);
+    file_get_contents(AS_FILE(folder), buffer);
+#ifdef DEBUG
+    fprintf(stderr, "folder_open buffer=");
+    for (i = 0; i < inode->filesize; ++i) fprintf(stderr, " %x", buffer[i]);
+    fprintf(stderr, "\n");
+#endif
+    nrecord = inode->filesize < 4 ? 0 : util_readint(buffer, 0);
+    // a log runs to the end of the content, but every item takes at least
+    // the 8 bytes of its len and page
+    if (s_features & FEATURE_FOLDER_LOG) nrecord = inode->filesize < 4 ? 0 : (inode->filesize - 4) / 8;
+#ifdef DEBUG
+    fprintf(stderr, "folder_open, nrecord=%d\n", nrecord);
+#endif
+    // the content bounds the arena with room for the terminators
+    folder->nitem = 0;
+    folder->item_cap = nrecord;
+    folder->items = (FolderItem *) malloc(sizeof(FolderItem) * (folder->item_cap + 1));
+    folder->names_cap = inode->filesize + 1;
+    folder->names = (char *) malloc(folder->names_cap);
+    folder->names_len = 0;
+    folder->dirty = 0;
+    folder->whole = 0;
+    folder->ndead = 0;
+    folder->nremoved = 0;
+    folder->removed_cap = 0;
+    folder->removed = NULL;
+    offset = 4;
+    for (i = 0; i < nrecord && offset + 8 <= inode->filesize; ++i) {
+        FolderItem *item = &folder->items[folder->nitem];
+        int cname_len = 0;
+        
+        cname_len = util_readint(buffer, offset);
+        item->at = offset;
+        item->type = (cname_len >> ITEM_TYPE_SHIFT) - 1;
+        cname_len &= ITEM_LEN_MASK;
         offset += 4;
+        item->page_num = util_readint(buffer, offset + cname_len);
+        if (!item->page_num && (s_features & FEATURE_FOLDER_LOG)) {
+            // removed
+            folder->ndead++;
+            offset += cname_len + 4;
+            continue;
+        }
+        item->off = folder->names_len;
+        item->len = cname_len;
+        item->hash = dedup_hash(buffer + offset, cname_len);
+        memcpy(folder->names + folder->names_len, buffer + offset, cname_len);
+        folder->names_len += cname_len;
+        folder->names[folder->names_len++] = 0;  // make it a string
+        offset += cname_len + 4;
+        folder->nitem++;
     }
+    folder->nsaved = folder->nitem;
     free(buffer);
     return folder;
 }
 
+// Writes back a modified folder. On volumes with FEATURE_FOLDER_LOG only
+// the items added since open are written, after the end of the content,
+// and removed ones are marked where they are, so a change costs the pages
+// it falls in whatever the size of the folder. A folder holding many
+// removed items is queued for fs_compact, which writes it whole.
 void folder_close(Folder **folder) {
-    if (folder && *folder) {
+    // a snapshot is never written
+    if (folder && *folder && (!(*folder)->dirty || AS_FILE(*folder)->fs->view || folder_log(*folder) == OK)) {
+        free((*folder)->items);
+        free((*folder)->names);
+        free((*folder)->removed);
+        free(*folder);
+        *folder = NULL;
+    } else if (folder && *folder) {
         int len = 0;
         int i = 0;
         char *buffer = NULL;
@@ -458,7 +2683,7 @@ void folder_close(Folder **folder) {
         len = 4;
         for (i = 0; i < (*folder)->nitem; ++i) {
             len += 4;
-            len += strlen((*folder)->items[i].cname);
+            len += (*folder)->items[i].len;
             len += 4;
         }
         buffer = (char *) malloc(len);
@@ -468,14 +2693,13 @@ void folder_close(Folder **folder) {
 #endif
         offset = 4;
         for (i = 0; i < (*folder)->nitem; ++i) {
-            int cname_len = 0;
+            FolderItem *item = &(*folder)->items[i];
             
-            cname_len = (int) strlen((*folder)->items[i].cname);
-            util_writeint(buffer, offset, cname_len);
+            util_writeint(buffer, offset, item->len | (item->type + 1) << ITEM_TYPE_SHIFT);
             offset += 4;
-            memcpy(buffer + offset, (*folder)->items[i].cname, cname_len);
-            offset += cname_len;
-            util_writeint(buffer, offset, (*folder)->items[i].page_num);
+            memcpy(buffer + offset, (*folder)->names + item->off, item->len);
+            offset += item->len;
+            util_writeint(buffer, offset, item->page_num);
             offset += 4;
         }
 #ifdef DEBUG
@@ -487,11 +2711,71 @@ void folder_close(Folder **folder) {
         file_put_contents(AS_FILE(*folder), buffer, len);
         free(buffer);
         free((*folder)->items);
+        free((*folder)->names);
+        free((*folder)->removed);
         free(*folder);
         *folder = NULL;
     }
 }
 
+// Marks the removed items and appends the added ones. Returns ERROR, with
+// what it wrote superseded by the whole write that follows, when the
+// folder is to be written whole or its pages are shared.
+int folder_log(Folder *folder) {
+    File *file = AS_FILE(folder);
+    FileSystem *fs = file->fs;
+    char *buffer = NULL;
+    int len = 0;
+    int offset = 0;
+    int i = 0;
+    
+    if (!(s_features & FEATURE_FOLDER_LOG) || folder->whole || file->inode->filesize < 4) return ERROR;
+    for (i = 0; i < folder->nremoved; ++i) {
+        if (file_patch(file, folder->removed[i], "\0\0\0\0", 4) != OK) return ERROR;
+    }
+    for (i = folder->nsaved; i < folder->nitem; ++i) {
+        len += 8 + folder->items[i].len;
+    }
+    buffer = (char *) malloc(len + 1);
+    for (i = folder->nsaved; i < folder->nitem; ++i) {
+        FolderItem *item = &folder->items[i];
+        
+        util_writeint(buffer, offset, item->len | (item->type + 1) << ITEM_TYPE_SHIFT);
+        memcpy(buffer + offset + 4, folder->names + item->off, item->len);
+        util_writeint(buffer, offset + 4 + item->len, item->page_num);
+        offset += 8 + item->len;
+    }
+    i = file_append(file, buffer, len);
+    free(buffer);
+    if (i != OK) return ERROR;
+    folder->ndead += folder->nremoved;
+    if (folder->ndead >= FOLDER_DEAD_MIN && folder->ndead > folder->nitem) {
+        fs_compact_push(fs, file->inode->page_num);
+    }
+    fs->stats.folder_appends++;
+    return OK;
+}
+
+const char* folder_item_name(Folder *folder, FolderItem *item) {
+    return folder->names + item->off;
+}
+
+// The index of the item named cname, or -1
+int folder_find(Folder *folder, const char *cname) {
+    int len = strlen(cname);
+    unsigned int hash = dedup_hash(cname, len);
+    int i = 0;
+    
+    for (i = 0; i < folder->nitem; ++i) {
+        FolderItem *item = &folder->items[i];
+        
+        if (item->hash == hash && item->len == len && 0 == memcmp(folder->names + item->off, cname, len)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 int folder_get_child(Folder *folder, const char *cname) {
     int i = 0;
 
@@ -499,48 +2783,86 @@ int folder_get_child(Folder *folder, const char *cname) {
     fprintf(stderr, "folder_get_child, cname=`%s`\n", cname);
     fprintf(stderr, "> folder->nitem=%d\n", folder->nitem);
 #endif
-    for (i = 0; i < folder->nitem; ++i) {
-#ifdef DEBUG
-        fprintf(stderr, "> folder->items[%d].cname=`%s`\n", i, folder->items[i].cname);
-#endif
-        if (0 == strcmp(cname, folder->items[i].cname)) {
-            return folder->items[i].page_num;
-        }
-    }
-    return -1;
+    i = folder_find(folder, cname);
+    return i < 0 ? -1 : folder->items[i].page_num;
 }
 
-void folder_add_child(Folder *folder, const char *cname, int page_num) {
-    FolderItem *new_items = NULL;
+void folder_add_child(Folder *folder, const char *cname, int page_num, int type) {
+    FolderItem *item = NULL;
+    int len = strlen(cname);
     
 #ifdef DEBUG
     fprintf(stderr, "folder_add_child, cname=`%s`, page_num=%d\n", cname, page_num);
 #endif
-    new_items = (FolderItem *) malloc(sizeof(FolderItem) * (folder->nitem + 1));
-    memcpy(new_items, folder->items, sizeof(FolderItem) * folder->nitem);
-    strcpy(new_items[folder->nitem].cname, cname);
-    new_items[folder->nitem].page_num = page_num;
-    free(folder->items);
-    folder->items = new_items;
-    folder->nitem++;
+    if (folder->nitem == folder->item_cap) {
+        folder->item_cap = folder->item_cap ? folder->item_cap * 2 : 8;
+        folder->items = (FolderItem *) realloc(folder->items, sizeof(FolderItem) * folder->item_cap);
+    }
+    if (folder->names_len + len + 1 > folder->names_cap) {
+        while (folder->names_len + len + 1 > folder->names_cap) folder->names_cap *= 2;
+        folder->names = (char *) realloc(folder->names, folder->names_cap);
+    }
+    item = &folder->items[folder->nitem++];
+    item->at = -1;
+    item->off = folder->names_len;
+    item->len = len;
+    item->hash = dedup_hash(cname, len);
+    item->page_num = page_num;
+    item->type = type;
+    memcpy(folder->names + folder->names_len, cname, len + 1);
+    folder->names_len += len + 1;
+    folder->dirty = 1;
 }
 
 void folder_remove_child(Folder *folder, const char *cname) {
-    int i = 0;
+    int i = folder_find(folder, cname);
     
-    for (i = 0; i < folder->nitem; ++i) {
-        if (0 == strcmp(cname, folder->items[i].cname)) {
-            break;
+    if (i >= 0 && i < folder->nsaved) {
+        if (folder->nremoved == folder->removed_cap) {
+            folder->removed_cap = folder->removed_cap ? folder->removed_cap * 2 : 8;
+            folder->removed = (int *) realloc(folder->removed, sizeof(int) * folder->removed_cap);
         }
+        // the page after the name
+        folder->removed[folder->nremoved++] = folder->items[i].at + 4 + folder->items[i].len;
+        folder->nsaved--;
     }
-    if (i < folder->nitem) {
+    if (i >= 0) {
         folder->nitem--;
-        while (i < folder->nitem) {
-            strcpy(folder->items[i].cname, folder->items[i + 1].cname);
-            folder->items[i].page_num = folder->items[i + 1].page_num;
-            i++;
-        }
+        memmove(folder->items + i, folder->items + i + 1, sizeof(FolderItem) * (folder->nitem - i));
+        folder->dirty = 1;
+    }
+}
+
+void folder_batch_init(FolderBatch *batch, FileSystem *fs) {
+    batch->fs = fs;
+    batch->nfolder = 0;
+    batch->folder_cap = 0;
+    batch->folders = NULL;
+}
+
+// The folder of the inode, opened unless the batch already has it
+Folder* folder_batch_open(FolderBatch *batch, Inode *inode) {
+    int i = 0;
+    
+    for (i = 0; i < batch->nfolder; ++i) {
+        if (AS_FILE(batch->folders[i])->inode->page_num == inode->page_num) return batch->folders[i];
+    }
+    if (batch->nfolder == batch->folder_cap) {
+        batch->folder_cap = batch->folder_cap ? batch->folder_cap * 2 : 8;
+        batch->folders = (Folder **) realloc(batch->folders, sizeof(Folder *) * batch->folder_cap);
     }
+    batch->folders[batch->nfolder] = folder_open(batch->fs, inode);
+    return batch->folders[batch->nfolder++];
+}
+
+// Writes back the folders that changed, each once
+void folder_batch_close(FolderBatch *batch) {
+    while (batch->nfolder) {
+        folder_close(&batch->folders[--batch->nfolder]);
+    }
+    free(batch->folders);
+    batch->folders = NULL;
+    batch->folder_cap = 0;
 }
 
 Inode* folder_lookup(FileSystem *fs, Inode *folder_inode, const char *path) {
@@ -603,86 +2925,123 @@ int skip_folder_item(const char *s) {
     return 0 == strcmp("", s) || 0 == strcmp(".", s) || 0 == strcmp("..", s);
 }
 
-void sort_strings(char **a, int n) {
-    int i, j;
+// files before folders, each in name order; names is the folder's arena
+int folder_item_cmp(const void *a, const void *b, void *names) {
+    const FolderItem *x = *(const FolderItem * const *) a;
+    const FolderItem *y = *(const FolderItem * const *) b;
     
-    for (i = 0; i < n; ++i)
-        for (j = 0; j < i; ++j)
-            if (strcmp(a[j], a[i]) > 0) {
-                char *t;
-                
-                t = a[j];
-                a[j] = a[i];
-                a[i] = t;
-            }
+    if (x->type != y->type) return x->type == INODE_FILE ? -1 : 1;
+    return strcmp((char *) names + x->off, (char *) names + y->off);
 }
 
-void folder_dump(FileSystem *fs, Inode *folder_inode, FILE *outfile) {
+// Lists entries [offset, offset + count) of the sorted listing, or all of
+// them when count is negative, as "files & folders" on one line.
+void folder_dump(FileSystem *fs, Inode *folder_inode, FILE *outfile, int offset, int count) {
     Folder *folder = NULL;
+    FolderItem **items = NULL;
+    int nitem = 0;
     int i = 0;
+    int end = 0;
     int nfile = 0;
-    int nfolder = 0;
-    char **file_names;
-    char **folder_names;
-    int ifile = 0;
-    int ifolder = 0;
     
     folder = folder_open(fs, folder_inode);
+    items = (FolderItem **) malloc(sizeof(FolderItem *) * (folder->nitem + 1));
     for (i = 0; i < folder->nitem; ++i) {
-        if (skip_folder_item(folder->items[i].cname)) continue;
-        if (fs_load_inode(fs, folder->items[i].page_num)->type == INODE_FILE) {
-            nfile++;
-        } else {
-            nfolder++;
-        }
-    }
-    file_names = malloc(sizeof(char *) * nfile);
-    folder_names = malloc(sizeof(char *) * nfolder);
-    for (i = 0; i < folder->nitem; ++i) {
-        if (skip_folder_item(folder->items[i].cname)) continue;
-        if (fs_load_inode(fs, folder->items[i].page_num)->type == INODE_FILE) {
-            file_names[ifile] = malloc(strlen(folder->items[i].cname) + 1);
-            strcpy(file_names[ifile], folder->items[i].cname);
-            ifile++;
-        } else {
-            folder_names[ifolder] = malloc(strlen(folder->items[i].cname) + 1);
-            strcpy(folder_names[ifolder], folder->items[i].cname);
-            ifolder++;
+        FolderItem *item = &folder->items[i];
+        
+        if (skip_folder_item(folder_item_name(folder, item))) continue;
+        if (ITEM_TYPE_UNKNOWN == item->type) {
+            // written before types were kept, record it now
+            Inode *inode = fs_load_inode(fs, item->page_num);
+            
+            item->type = inode ? inode->type : INODE_FILE;
+            folder->dirty = 1;
+            folder->whole = 1;
         }
+        items[nitem++] = item;
     }
-    sort_strings(file_names, nfile);
-    sort_strings(folder_names, nfolder);
-    for (i = 0; i < nfile; ++i) {
-        if (i) fprintf(outfile, " ");
-        fprintf(outfile, "%s", file_names[i]);
+    qsort_r(items, nitem, sizeof(FolderItem *), folder_item_cmp, folder->names);
+    if (offset < 0) offset = 0;
+    if (offset > nitem) offset = nitem;
+    end = count < 0 || count > nitem - offset ? nitem : offset + count;
+    for (i = offset; i < end && items[i]->type == INODE_FILE; ++i) {
+        if (nfile++) fprintf(outfile, " ");
+        fprintf(outfile, "%s", folder_item_name(folder, items[i]));
     }
     fprintf(outfile, " & ");
-    for (i = 0; i < nfolder; ++i) {
-        if (i) fprintf(outfile, " ");
-        fprintf(outfile, "%s", folder_names[i]);
+    for (nfile = i; i < end; ++i) {
+        if (i > nfile) fprintf(outfile, " ");
+        fprintf(outfile, "%s", folder_item_name(folder, items[i]));
     }
     fprintf(outfile, "\n");
     fflush(outfile);
-    free(file_names);
-    free(folder_names);
+    free(items);
     folder_close(&folder);
 }
 
-enum { OK = 0, ERROR };
+// Pick up the page size of the volume from its superblock
+int fs_mount(FileSystem *fs) {
+    char *super = storage_pages(fs->stor, 0, 1);
+    int shift = util_readint(super, 4);
+    
+    if (util_readint(super, 0) == SUPER_MAGIC && shift >= PAGE_SHIFT_MIN && shift <= PAGE_SHIFT_MAX
+            && util_readint(super, 8) == NUM_SECTORS() >> (shift - SECTOR_SHIFT)) {
+        s_page_shift = shift;
+        s_freelist_first = 1;
+        s_features = util_readint(super, 12);
+        s_itable_pages = (s_features & FEATURE_ITABLE) ? util_readint(super, SUPER_ITABLE) : 0;
+    } else {
+        s_page_shift = SECTOR_SHIFT;
+        s_freelist_first = 0;
+        s_features = 0;
+        s_itable_pages = 0;
+    }
+    s_page_ops = &s_page_ops_table[s_page_shift - PAGE_SHIFT_MIN];
+    return OK;
+}
 
-void fs_init(FileSystem *fs) {
-    fs->stor = (Storage *) malloc(sizeof(Storage));
-    fs->stor->c = malloc(sizeof(char) * NUM_SECTORS() * 256);
+void fs_init(FileSystem *fs, Storage *stor) {
+    fs->stor = stor;
+    fs->format_shift = SECTOR_SHIFT;
+    fs->format_itable = 0;
+    fs->compress = 0;
+    fs->dedup = 0;
+    fs->view = 0;
+    fs->nview = 0;
+    fs->view_cap = 0;
+    fs->views = NULL;
+    fs->view_pages = NULL;
+    fs->session = NULL;
+    fs->delay_us = 0;
+    fs->ndelayed = 0;
+    fs->delayed_cap = 0;
+    fs->delayed = NULL;
+    fs->removals = 0;
+    fs->sessions = NULL;
+    fs->nsession = 0;
+    fs_mount(fs);
+    fs->gen = 0;
+    fs->inode_gen = (unsigned int *) calloc(NUM_INODES(), sizeof(unsigned int));
+    memset(&fs->stats, 0, sizeof(Stats));
+    fs->ninode = 0;
+    fs->nreclaim = 0;
+    fs->reclaim_cap = 0;
+    fs->reclaim = NULL;
+    fs->ncompact = 0;
+    fs->compact_cap = 0;
+    fs->compact = NULL;
     fs->freelist = freelist_new(fs);
+    fs->itable_free = NULL;
+    fs_itable_scan(fs);
+    fs->snapshots = snapshot_table_new(fs);
     fs->cur = fs_load_inode(fs, ROOT_PAGE_NUM());
-    fs->ninode = 0;
 }
 
-FileSystem* fs_new() {
+FileSystem* fs_new(Storage *stor) {
     FileSystem *fs = NULL;
     
     fs = (FileSystem *) malloc(sizeof(FileSystem));
-    fs_init(fs);
+    fs_init(fs, stor);
     return fs;
 }
 
@@ -690,287 +3049,624 @@ void fs_free(FileSystem **fs) {
     if (fs && *fs) {
         int i = 0;
         
+        // finish freeing removed trees so their pages are not lost
+        while ((*fs)->nreclaim) {
+            fs_reclaim(*fs, RECLAIM_BATCH);
+        }
+        free((*fs)->reclaim);
+        free((*fs)->compact);
+        fs_set_view(*fs, 0);
+        free((*fs)->views);
+        free((*fs)->view_pages);
+        // saving inodes may copy pages out for the snapshots, so the table
+        // goes after them
+        for (i = 0; i < (*fs)->ninode; ++i) {
+            fs_save_inode(*fs, (*fs)->inodes[i]);
+        }
+        snapshot_table_free(&(*fs)->snapshots, 1);
         for (i = 0; i < (*fs)->ninode; ++i) {
             fs_save_inode(*fs, (*fs)->inodes[i]);
             free((*fs)->inodes[i]);
         }
         (*fs)->ninode = 0;
+        free((*fs)->delayed);
         freelist_free((*fs)->freelist);
         (*fs)->freelist = NULL;
+        free((*fs)->itable_free);
+        free((*fs)->inode_gen);
+        storage_close(&(*fs)->stor);
         free(*fs);
         *fs = NULL;
     }
 }
 
-int fs_format(FileSystem *fs) {
+// Page 0 becomes the superblock, then come the freemap and the root inode,
+// whose three items are kept inline. With inode_bytes the root's page is
+// taken by an inode table with an inode for every inode_bytes of volume,
+// and the root's items go in the page after it. Returns ERROR, leaving the
+// volume as it was, when that does not leave a page free.
+int fs_format(FileSystem *fs, int page_shift, int inode_bytes) {
     int i = 0;
-    int sec = 0;
-    char buffer[256] = "";
+    int page = 0;
+    int npage = 0;
+    int nfixed = 0;
+    char *root = NULL;
+    char *map = NULL;
     
+    if (page_shift < PAGE_SHIFT_MIN || page_shift > PAGE_SHIFT_MAX) return ERROR;
+    if (inode_bytes && inode_bytes < SECTOR_SIZE) return ERROR;
+    // the superblock, the freemap, the inode table and the root's page
+    npage = NUM_SECTORS() >> (page_shift - SECTOR_SHIFT);
+    nfixed = 1 + ((npage + (1 << page_shift) - 1) >> page_shift) + 1;
+    if (inode_bytes) {
+        long long ninode = ((long long) npage << page_shift) / inode_bytes;
+        int slots = (1 << page_shift) / INODE_SLOT_BYTES;
+        
+        nfixed += (ninode + slots - 1) / slots;
+    }
+    if (npage <= nfixed) {
+        fprintf(stderr, "The volume of %d sectors is too small for %d byte pages\n", NUM_SECTORS(), 1 << page_shift);
+        return ERROR;
+    }
     for (i = 0; i < fs->ninode; ++i) {
         fs_save_inode(fs, fs->inodes[i]);
         free(fs->inodes[i]);
     }
     fs->ninode = 0;
+    fs->nreclaim = 0;
+    fs->ncompact = 0;
+    fs->removals++;
+    fs_set_view(fs, 0);
+    snapshot_table_free(&fs->snapshots, 0);
     freelist_free(fs->freelist);
     fs->freelist = NULL;
-    for (sec = 0; sec < FREELIST_NSEC(); ++sec) {
-        for (i = 0; i < 256 / 4; ++i) {
-            storage_writeint(fs->stor, sec, i * 4, 0);
-        }
+    s_page_shift = page_shift;
+    s_freelist_first = 1;
+    s_features = FEATURE_ENCODING | FEATURE_TAIL | FEATURE_FOLDER_LOG;
+    s_itable_pages = 0;
+    if (inode_bytes) {
+        int ninode = (long long) NUM_PAGES() * PAGE_SIZE() / inode_bytes;
+        
+        s_features |= FEATURE_ITABLE;
+        s_itable_pages = (ninode + ITABLE_SLOTS() - 1) / ITABLE_SLOTS();
+    }
+    s_page_ops = &s_page_ops_table[s_page_shift - PAGE_SHIFT_MIN];
+    // no page kept from before names anything now
+    fs->inode_gen = (unsigned int *) realloc(fs->inode_gen, sizeof(unsigned int) * NUM_INODES());
+    fs->gen++;
+    for (i = 0; i < NUM_INODES(); ++i) {
+        fs->inode_gen[i] = fs->gen;
     }
-    storage_writeint(fs->stor, ROOT_PAGE_NUM(), 0, INODE_FOLDER);
-    storage_writeint(fs->stor, ROOT_PAGE_NUM(), 4, 31);
-    storage_writeint(fs->stor, ROOT_PAGE_NUM(), 16, ROOT_PAGE_NUM() + 1);
-    storage_writeint(fs->stor, ROOT_PAGE_NUM(), CONTENT_BYTES_PER_PAGE, INODE_MAGIC_NUMBER);
-    util_writeint(buffer, 0, 3);
+    memset(fs_page(fs, 0), 0, PAGE_SIZE());
+    util_writeint(fs_page(fs, 0), 0, SUPER_MAGIC);
+    util_writeint(fs_page(fs, 0), 4, page_shift);
+    util_writeint(fs_page(fs, 0), 8, NUM_PAGES());
+    util_writeint(fs_page(fs, 0), 12, s_features);
+    util_writeint(fs_page(fs, 0), SUPER_ITABLE, s_itable_pages);
+    fs_mark_dirty(fs, 0);
+    map = freelist_map(fs);
+    memset(map, 0, FREELIST_NSEC() * PAGE_SIZE());
+    // the superblock, the freemap itself, the inode table and the page of
+    // the root's items are never free
+    for (page = 0; page <= ITABLE_FIRST() + s_itable_pages; ++page) {
+        map[page] = 1;
+    }
+    freelist_map_dirty(fs);
+    if (s_itable_pages) {
+        int k = s_page_shift - SECTOR_SHIFT;
+        
+        memset(storage_pages(fs->stor, ITABLE_FIRST() << k, s_itable_pages << k), 0, s_itable_pages * PAGE_SIZE());
+        storage_mark_dirty_pages(fs->stor, ITABLE_FIRST() << k, s_itable_pages << k);
+    }
+    page = ITABLE_FIRST() + s_itable_pages;
+    memset(fs_page(fs, page), 0, PAGE_SIZE());
+    root = fs_page(fs, INODE_PAGE(ROOT_PAGE_NUM())) + INODE_OFFSET(ROOT_PAGE_NUM());
+    util_writeint(root, 0, INODE_FOLDER);
+    util_writeint(root, 4, 31);
+    util_writeint(root, 8, ENCODING_RAW);
+    util_writeint(root, 12, 31);
+    util_writeint(root, 16, s_itable_pages ? page : 0);
+    util_writeint(root, INODE_MAGIC_OFFSET(), INODE_MAGIC_NUMBER);
+    if (s_itable_pages) {
+        util_writeint(root, INODE_TAIL_OFFSET, page);
+        fs_mark_dirty(fs, INODE_PAGE(ROOT_PAGE_NUM()));
+        root = fs_page(fs, page);
+    } else {
+        root += INODE_INLINE_OFFSET;
+    }
+    util_writeint(root, 0, 3);
     // first item ""
-    util_writeint(buffer, 4, 0);
-    util_writeint(buffer, 8, ROOT_PAGE_NUM());
+    util_writeint(root, 4, 0 | (INODE_FOLDER + 1) << ITEM_TYPE_SHIFT);
+    util_writeint(root, 8, ROOT_PAGE_NUM());
     // second item "."
-    util_writeint(buffer, 12, 1);
-    buffer[16] = '.';
-    util_writeint(buffer, 17, ROOT_PAGE_NUM());
+    util_writeint(root, 12, 1 | (INODE_FOLDER + 1) << ITEM_TYPE_SHIFT);
+    root[16] = '.';
+    util_writeint(root, 17, ROOT_PAGE_NUM());
     // third item ".."
-    util_writeint(buffer, 21, 2);
-    buffer[25] = '.';
-    buffer[26] = '.';
-    util_writeint(buffer, 27, ROOT_PAGE_NUM());
-    storage_writepage(fs->stor, ROOT_PAGE_NUM() + 1, buffer);
+    util_writeint(root, 21, 2 | (INODE_FOLDER + 1) << ITEM_TYPE_SHIFT);
+    root[25] = '.';
+    root[26] = '.';
+    util_writeint(root, 27, ROOT_PAGE_NUM());
+    fs_mark_dirty(fs, page);
     fs->freelist = freelist_new(fs);
+    fs_itable_scan(fs);
+    fs->snapshots = snapshot_table_new(fs);
     fs->cur = fs_load_inode(fs, ROOT_PAGE_NUM());
     return OK;
 }
 
-int fs_exists(FileSystem *fs, const char *f) {
-    return NULL != folder_lookup(fs, fs->cur, f);
+// Fills in what path resolves to with one walk: the folders up to its
+// last / are looked up, then the last name in the folder they end in.
+// A path ending in / names that folder itself, as folder_lookup has it.
+// Returns lookup->inode.
+Inode* fs_lookup(FileSystem *fs, const char *path, Lookup *lookup) {
+    const char *rpos = NULL;
+    Folder *pfd = NULL;
+    
+    rpos = strrchr(path, '/');
+    lookup->cname = rpos ? rpos + 1 : path;
+    lookup->inode = NULL;
+    if (!rpos) {
+        // a bare name is looked up in the working directory without
+        // opening it for its .
+        lookup->parent = fs->cur;
+    } else {
+        char ppath[4096] = "";
+        
+        strncpy(ppath, path, rpos + 1 - path);
+        ppath[rpos + 1 - path] = 0;
+        lookup->parent = folder_lookup(fs, fs->cur, ppath);
+    }
+    if (!lookup->parent || lookup->parent->type != INODE_FOLDER) {
+        lookup->parent = NULL;
+        return NULL;
+    }
+    if (!lookup->cname[0]) {
+        lookup->inode = lookup->parent;
+        lookup->parent = NULL;
+        return lookup->inode;
+    }
+    pfd = folder_open(fs, lookup->parent);
+    lookup->inode = fs_load_inode(fs, folder_get_child(pfd, lookup->cname));
+    folder_close(&pfd);
+    return lookup->inode;
 }
 
-int fs_isfile(FileSystem *fs, const char *f) {
-    Inode *inode = NULL;
+// The file path names, NULL when it names a folder or nothing
+Inode* fs_lookup_file(FileSystem *fs, const char *path) {
+    Lookup lookup;
     
-    inode = folder_lookup(fs, fs->cur, f);
-    return inode && inode->type == INODE_FILE;
+    if (!fs_lookup(fs, path, &lookup) || lookup.inode->type != INODE_FILE) return NULL;
+    return lookup.inode;
 }
 
-int fs_isdir(FileSystem *fs, const char *d) {
+// Makes the file or folder path names. With parents the folders on the
+// way that do not exist are made too and a folder already there is no
+// error, as mkdir -p. Names are looked up one folder after another as
+// folder_lookup does, through batch, so they see what the request has
+// made so far.
+int fs_make(FileSystem *fs, FolderBatch *batch, const char *path, int type, int parents) {
+    char cname[4096] = "";
+    Inode *parent = fs->cur;
     Inode *inode = NULL;
+    int child = 0;
+    int len = 0;
     
-    inode = folder_lookup(fs, fs->cur, d);
-#ifdef DEBUG
-    fprintf(stderr, "fs_isdir inode=%p\n", inode);
-    if (inode) {
-        fprintf(stderr, "INODE_FILE=%d, INODE_FOLDER=%d\n", INODE_FILE, INODE_FOLDER);
-        fprintf(stderr, "fs_isdir inode->type=%d\n", inode->type);
+    for (;;) {
+        if (!parent || parent->type != INODE_FOLDER) return ERROR;
+        len = strcspn(path, "/");
+        memcpy(cname, path, len);
+        cname[len] = 0;
+        child = folder_get_child(folder_batch_open(batch, parent), cname);
+        if (!path[len]) break;
+        path += len + 1;
+        if (child < 0 && parents) child = fs_mkdir(fs, batch, parent, cname);
+        parent = fs_load_inode(fs, child);
     }
-#endif
-    return inode && inode->type == INODE_FOLDER;
-}
-
-void fs_split_path(const char *path, char *ppath, char *cname) {
-    char *rpos = NULL;
-    
-    rpos = strrchr(path, '/');
-    if (rpos) {
-        if (ppath) strncpy(ppath, path, rpos - path);
-        if (cname) strcpy(cname, rpos + 1);
-    } else {
-        if (ppath) strcpy(ppath, "");
-        if (cname) strcpy(cname, path);
+    // a path ending in / names the folder it ends in
+    if (!cname[0]) return parents ? OK : ERROR;
+    if (child >= 0) {
+        inode = fs_load_inode(fs, child);
+        return parents && inode && inode->type == INODE_FOLDER ? OK : ERROR;
     }
+    child = type == INODE_FILE ? fs_create(fs, batch, parent, cname) : fs_mkdir(fs, batch, parent, cname);
+    return child < 0 ? ERROR : OK;
 }
 
-int fs_create(FileSystem *fs, const char *f) {
+// Makes a file named cname in the folder parent. Returns its inode, or -1
+int fs_create(FileSystem *fs, FolderBatch *batch, Inode *parent, const char *cname) {
     int p = 0;
     Inode *inode = NULL;
-    char ppath[4096] = "";
-    char cname[4096] = "";
-    Folder *pfd = NULL;
     
-    p = freelist_allocate(fs->freelist);
-    if (p <= 1) return ERROR;
+    // the inode goes next to its folder's
+    p = fs_inode_allocate(fs, parent->page_num);
+    if (p <= 1) return -1;
     inode = inode_new(p);
-    if (!inode) return ERROR;
+    if (!inode) return -1;
     inode->type = INODE_FILE;
     inode->filesize = 0;
     inode->firstpage = 0;
     fs_save_inode(fs, inode);
     inode_free(&inode);
     
-    fs_split_path(f, ppath, cname);
-    pfd = folder_open(fs, folder_lookup(fs, fs->cur, ppath));
-    folder_add_child(pfd, cname, p);
-    folder_close(&pfd);
-    return OK;
+    folder_add_child(folder_batch_open(batch, parent), cname, p, INODE_FILE);
+    return p;
 }
 
-int fs_mkdir(FileSystem *fs, const char *d) {
+// Makes a folder named cname in the folder parent. Returns its inode, or -1
+int fs_mkdir(FileSystem *fs, FolderBatch *batch, Inode *parent, const char *cname) {
     int p = 0;
     Inode *inode = NULL;
     Folder *fd = NULL;
-    char ppath[4096] = "";
-    char cname[4096] = "";
-    Folder *pfd = NULL;
-    int parent_page_num = 0;
+    int parent_page_num = parent->page_num;
     
-    p = freelist_allocate(fs->freelist);
-    if (p <= 1) return ERROR;
+    p = fs_inode_allocate(fs, parent_page_num);
+    if (p <= 1) return -1;
     inode = inode_new(p);
-    if (!inode) return ERROR;
+    if (!inode) return -1;
     inode->type = INODE_FOLDER;
     inode->filesize = 0;
     inode->firstpage = 0;
     fs_save_inode(fs, inode);
     inode_free(&inode);
     
-    fs_split_path(d, ppath, cname);
 #ifdef DEBUG
-    fprintf(stderr, "fs_mkdir, d=`%s`, ppath=`%s`, cname=`%s`\n", d, ppath, cname);
+    fprintf(stderr, "fs_mkdir, cname=`%s`\n", cname);
 #endif
     
-    pfd = folder_open(fs, folder_lookup(fs, fs->cur, ppath));
-    parent_page_num = AS_FILE(pfd)->inode->page_num;
-    folder_add_child(pfd, cname, p);
+    folder_add_child(folder_batch_open(batch, parent), cname, p, INODE_FOLDER);
+    fd = folder_batch_open(batch, fs_load_inode(fs, p));
+    folder_add_child(fd, "", ROOT_PAGE_NUM(), INODE_FOLDER);
+    folder_add_child(fd, ".", p, INODE_FOLDER);
+    folder_add_child(fd, "..", parent_page_num, INODE_FOLDER);
+    return p;
+}
+
+int fs_unlink(FileSystem *fs, Lookup *lookup) {
+    Folder *pfd = NULL;
+    
+    if (ERROR == fs_write(fs, lookup->inode, 0, "")) return ERROR;
+    fs_inode_release(fs, lookup->inode->page_num);
+    fs->removals++;
+    pfd = folder_open(fs, lookup->parent);
+    folder_remove_child(pfd, lookup->cname);
     folder_close(&pfd);
+    return OK;
+}
+
+int fs_chdir(FileSystem *fs, Inode *inode) {
+    if (!inode) return ERROR;
+    fs->cur = inode;
+    return OK;
+}
+
+// Whether the live folder at page_num is folder or lies beneath it,
+// found by following .. up to the root
+int fs_within(FileSystem *fs, int page_num, int folder) {
+    Inode *inode = NULL;
+    Folder *fd = NULL;
+    int depth = 0;
+    
+    while (page_num != folder) {
+        if (page_num == ROOT_PAGE_NUM() || ++depth > NUM_INODES()) return 0;
+        inode = fs_load_inode(fs, page_num);
+        if (!inode || inode->type != INODE_FOLDER) return 0;
+        fd = folder_open(fs, inode);
+        page_num = folder_get_child(fd, "..");
+        folder_close(&fd);
+    }
+    return 1;
+}
+
+// Detaches the directory from its parent and returns; the tree below is
+// freed by fs_reclaim in the background. A folder a session is in, or
+// one above it, stays.
+int fs_rmdir(FileSystem *fs, Lookup *lookup) {
+    Inode *inode = lookup->inode;
+    Inode *parent = lookup->parent;
+    Folder *pfd = NULL;
+    int page_num = 0;
+    int i = 0;
     
-    fd = folder_open(fs, fs_load_inode(fs, p));
-    fs_split_path(d, ppath, cname);
-    folder_add_child(fd, "", ROOT_PAGE_NUM());
-    folder_add_child(fd, ".", p);
-    folder_add_child(fd, "..", parent_page_num);
-    folder_close(&fd);
+    if (!inode || inode->page_num == ROOT_PAGE_NUM()) return ERROR;
+    if (!parent || skip_folder_item(lookup->cname)) return ERROR;
+    page_num = inode->page_num;
+    if (fs->cur && fs_within(fs, fs->cur->page_num, page_num)) return ERROR;
+    for (i = 0; i < fs->nsession; ++i) {
+        struct Session *session = fs->sessions[i];
+        
+        if (session != fs->session && !session->view && fs_within(fs, session->cur, page_num)) return ERROR;
+    }
+    pfd = folder_open(fs, parent);
+    folder_remove_child(pfd, lookup->cname);
+    folder_close(&pfd);
+    fs->removals++;
+    fs_reclaim_push(fs, page_num);
     return OK;
 }
 
-int fs_unlink(FileSystem *fs, const char *f) {
-    Inode *inode = NULL;
-    char ppath[4096] = "";
-    char cname[4096] = "";
-    Folder *pfd = NULL;
+void fs_reclaim_push(FileSystem *fs, int page_num) {
+    if (fs->nreclaim == fs->reclaim_cap) {
+        fs->reclaim_cap = fs->reclaim_cap ? fs->reclaim_cap * 2 : 64;
+        fs->reclaim = (int *) realloc(fs->reclaim, sizeof(int) * fs->reclaim_cap);
+    }
+    fs->reclaim[fs->nreclaim++] = page_num;
+}
+
+// Frees detached inodes until about budget pages went back to the free
+// list. A folder's children are queued before the folder itself goes, so
+// the walk needs no more memory than the pending inodes. Returns the
+// number of pages freed.
+int fs_reclaim(FileSystem *fs, int budget) {
+    int nfreed = 0;
+    
+    while (fs->nreclaim && nfreed < budget) {
+        Inode *inode = NULL;
+        File *file = NULL;
+        int page_num = 0;
+        
+        page_num = fs->reclaim[--fs->nreclaim];
+        inode = fs_load_inode(fs, page_num);
+        if (!inode) continue;
+        if (inode->type == INODE_FOLDER) {
+            Folder *folder = folder_open(fs, inode);
+            int i = 0;
+            
+            for (i = 0; i < folder->nitem; ++i) {
+                if (skip_folder_item(folder_item_name(folder, &folder->items[i]))) continue;
+                fs_reclaim_push(fs, folder->items[i].page_num);
+            }
+            folder_close(&folder);
+        }
+        nfreed += (inode->stored + CONTENT_BYTES() - 1) / CONTENT_BYTES() + 1;
+        file = file_new(fs, inode);
+        file_put_contents(file, "", 0);
+        file_free(&file);
+        fs_inode_release(fs, page_num);
+    }
+    return nfreed;
+}
+
+// Queues the folder for fs_compact, once
+void fs_compact_push(FileSystem *fs, int page_num) {
+    int i = 0;
+    
+    for (i = 0; i < fs->ncompact; ++i) {
+        if (fs->compact[i] == page_num) return;
+    }
+    if (fs->ncompact == fs->compact_cap) {
+        fs->compact_cap = fs->compact_cap ? fs->compact_cap * 2 : 16;
+        fs->compact = (int *) realloc(fs->compact, sizeof(int) * fs->compact_cap);
+    }
+    fs->compact[fs->ncompact++] = page_num;
+}
+
+// Writes a queued folder whole, without the items removed from it. The
+// inode may since have been freed or taken by a file, then it is left.
+// Runs between requests, on the live tree. Returns the number of folders
+// looked at.
+int fs_compact(FileSystem *fs) {
+    Inode *inode = NULL;
+    Folder *folder = NULL;
+    
+    if (!fs->ncompact || fs->view) return 0;
+    inode = fs_load_inode(fs, fs->compact[--fs->ncompact]);
+    if (!inode || inode->type != INODE_FOLDER) return 0;
+    folder = folder_open(fs, inode);
+    if (folder->ndead) {
+        folder->dirty = 1;
+        folder->whole = 1;
+        fs->stats.folder_compactions++;
+    }
+    folder_close(&folder);
+    return 1;
+}
+
+void fs_ls(FileSystem *fs, FILE *fp, int offset, int count) {
+    if (!fs->cur) {
+        fprintf(fp, " & \n");
+        fflush(fp);
+        return;
+    }
+    folder_dump(fs, fs->cur, fp, offset, count);
+}
+
+// Sends iov as the next part of the reply on fp. While a session is
+// served it goes to the socket with writev, so pages are not copied.
+void fs_reply(FileSystem *fs, FILE *fp, struct iovec *iov, int n) {
+    int i = 0;
+    
+    fflush(fp);
+    if (fs->session) {
+        session_writev(fs->session, iov, n);
+        return;
+    }
+    for (i = 0; i < n; ++i) {
+        fwrite(iov[i].iov_base, 1, iov[i].iov_len, fp);
+    }
+}
+
+// Replies [filesize]\n, the content and \n, so any byte can be in a file.
+// Raw content goes out page by page, compressed content an extent at a
+// time; nothing the size of the file is allocated.
+void fs_cat(FileSystem *fs, Inode *inode, FILE *fp) {
+    File file;
+    
+    file_init(&file, fs, inode);
+    fprintf(fp, "%d\n", inode->filesize);
+    if (inode->delayed) {
+        struct iovec iov;
+        
+        iov.iov_base = inode->delayed;
+        iov.iov_len = inode->filesize;
+        if (inode->filesize) fs_reply(fs, fp, &iov, 1);
+        fs->stats.bytes_read += inode->filesize;
+    } else if (inode->encoding == ENCODING_RAW) {
+        s_page_ops->send(&file, fp);
+        fs->stats.bytes_read += inode->filesize;
+    } else {
+        char *extent = (char *) malloc(EXTENT_BYTES);
+        struct iovec iov;
+        int offset = 0;
+        
+        iov.iov_base = extent;
+        for (offset = 0; offset < inode->filesize; offset += iov.iov_len) {
+            iov.iov_len = file_pread(&file, extent, offset, EXTENT_BYTES);
+            fs_reply(fs, fp, &iov, 1);
+        }
+        free(extent);
+    }
+    fprintf(fp, "\n");
+    fflush(fp);
+}
+
+void fs_pread(FileSystem *fs, Inode *inode, int pos, int l, FILE *fp) {
+    File file;
     
-    if (ERROR == fs_write(fs, f, 0, "")) return ERROR;
-    inode = folder_lookup(fs, fs->cur, f);
-    if (!inode) return ERROR;
-    freelist_release(fs->freelist, inode->page_num);
-    fs_split_path(f, ppath, cname);
-    pfd = folder_open(fs, folder_lookup(fs, fs->cur, ppath));
-    folder_remove_child(pfd, cname);
-    folder_close(&pfd);
-    return OK;
+    file_init(&file, fs, inode);
+    file_reply_range(&file, pos, l, fp);
 }
 
-int fs_chdir(FileSystem *fs, const char *path) {
-    Inode *inode = NULL;
+int fs_write(FileSystem *fs, Inode *inode, int l, const char *data) {
+    File file;
     
-    inode = folder_lookup(fs, fs->cur, path);
-    if (!inode) return ERROR;
-    fs->cur = inode;
-    return OK;
+    file_init(&file, fs, inode);
+    return file_put_contents(&file, data, l);
 }
 
-int fs_rmdir(FileSystem *fs, const char *d) {
-    // TODO what if there are children in this directory?
-    Inode *inode = NULL;
-    char ppath[4096] = "";
-    char cname[4096] = "";
-    Folder *pfd = NULL;
+int fs_insert(FileSystem *fs, Inode *inode, int pos, int l, const char *data) {
+    File file;
     
-    if (ERROR == fs_write(fs, d, 0, "")) return ERROR;
-    inode = folder_lookup(fs, fs->cur, d);
-    if (!inode) return ERROR;
-    freelist_release(fs->freelist, inode->page_num);
-    fs_split_path(d, ppath, cname);
-    pfd = folder_open(fs, folder_lookup(fs, fs->cur, ppath));
-    folder_remove_child(pfd, cname);
-    folder_close(&pfd);
-    return OK;
+    file_init(&file, fs, inode);
+    return file_insert(&file, pos, l, data);
 }
 
-void fs_ls(FileSystem *fs, FILE *fp) {
-    folder_dump(fs, fs->cur, fp);
+int fs_append(FileSystem *fs, Inode *inode, int l, const char *data) {
+    File file;
+    
+    file_init(&file, fs, inode);
+    return file_append(&file, data, l);
 }
 
-void fs_cat(FileSystem *fs, const char *f, FILE *fp) {
-    Inode *inode = NULL;
-    char *data = NULL;
-    File *file = NULL;
+int fs_delete(FileSystem *fs, Inode *inode, int pos, int l) {
+    File file;
     
-    inode = folder_lookup(fs, fs->cur, f);
-    data = (char *) malloc(inode->filesize);
-    file = file_new(fs, inode);
-    file_get_contents(file, data);
-    file_free(&file);
-    fprintf(fp, "%s\n", data);
-    fflush(fp);
-    free(data);
+    file_init(&file, fs, inode);
+    return file_delete(&file, pos, l);
 }
 
-int fs_write(FileSystem *fs, const char *f, int l, const char *data) {
+// Starts taking the size bytes that follow a put. They are taken whatever
+// happens, so the requests after them are found; a put that cannot be
+// done fails once they have all come.
+void fs_put_begin(FileSystem *fs, const char *f, int size, const char *line) {
+    Upload *up = &fs->session->upload;
     Inode *inode = NULL;
-    File *file = NULL;
     
-    inode = folder_lookup(fs, fs->cur, f);
-    if (!inode) return ERROR;
-    file = file_new(fs, inode);
-    file_put_contents(file, data, l);
-    file_free(&file);
-    return OK;
+    memset(up, 0, sizeof(Upload));
+    up->active = 1;
+    up->size = up->left = size;
+    up->at = util_now_us();
+    up->line = strdup(line);
+    inode = fs_lookup_file(fs, f);
+    up->failed = fs->view || !inode || (size + CONTENT_BYTES() - 1) / CONTENT_BYTES() > freelist_room(fs->freelist);
+    if (!up->failed) up->near = INODE_PAGE(inode->page_num);
 }
 
-int fs_insert(FileSystem *fs, const char *f, int pos, int l, const char *data) {
+// Gives the received chain to the file in place of what it held, or to
+// its inode page when it fits there
+int fs_put_end(FileSystem *fs, Upload *up) {
+    char f[4096] = "";
     Inode *inode = NULL;
-    char *buffer = NULL;
-    File *file = NULL;
-    int i = 0;
+    File file;
     
-    inode = folder_lookup(fs, fs->cur, f);
-    if (!inode) return ERROR;
-    buffer = (char *) malloc(inode->filesize + l);
-    if (!buffer) return ERROR;
-    file = file_new(fs, inode);
-    file_get_contents(file, buffer);
-    file_free(&file);
-    if (pos > inode->filesize) {
-        pos = inode->filesize;
+    sscanf(up->line, "%*s %4095s", f);
+    if (up->failed || !(inode = fs_lookup_file(fs, f))) {
+        fs_put_drop(fs, up);
+        return ERROR;
     }
-    for (i = inode->filesize - 1; i >= pos; --i) {
-        buffer[i + l] = buffer[i];
+    file_init(&file, fs, inode);
+    free(fs_undelay(fs, inode));
+    if (up->size <= INLINE_BYTES()) {
+        s_page_ops->write(&file, up->first ? fs_page(fs, up->first) : "", up->size);
+        fs_put_drop(fs, up);
+    } else {
+        s_page_ops->write(&file, "", 0);
+        inode->firstpage = up->first;
+        inode->lastpage = up->last;
     }
-    memcpy(buffer + pos, data, l);
-    file = file_new(fs, inode);
-    file_put_contents(file, buffer, inode->filesize + l);
-    file_free(&file);
-    free(buffer);
+    inode->encoding = ENCODING_RAW;
+    inode->filesize = inode->stored = up->size;
+    fs->stats.bytes_written += up->size;
     return OK;
 }
 
-int fs_delete(FileSystem *fs, const char *f, int pos, int l) {
+// Frees the chain a put received
+void fs_put_drop(FileSystem *fs, Upload *up) {
+    int page = up->first;
+    
+    while (page) {
+        int next = fs_readint(fs, page, CONTENT_BYTES());
+        
+        freelist_release(fs->freelist, page);
+        page = next;
+    }
+    up->first = up->last = 0;
+}
+
+// Binds the lowest free handle of the session to the file f names.
+// Returns the handle, -1 when f is no file or every handle is in use.
+int fs_open(FileSystem *fs, const char *f) {
+    Handle *handle = NULL;
     Inode *inode = NULL;
-    char *data = NULL;
-    File *file = NULL;
-    int i = 0;
+    int dir = 0;
+    int h = 0;
     
+    dir = fs_inode_page(fs, fs->cur);
     inode = folder_lookup(fs, fs->cur, f);
-    if (!inode) return ERROR;
-    data = (char *) malloc(inode->filesize);
-    if (!data) return ERROR;
-    file = file_new(fs, inode);
-    file_get_contents(file, data);
-    file_free(&file);
-    if (pos + l > inode->filesize) {
-        l = inode->filesize - pos;
-    }
-    for (i = pos + l; i < inode->filesize; ++i) {
-        data[i - l] = data[i];
-    }
-    file = file_new(fs, inode);
-    file_put_contents(file, data, inode->filesize - l);
-    file_free(&file);
-    free(data);
+    if (!inode || inode->type != INODE_FILE) return -1;
+    for (h = 0; h < SESSION_HANDLES && fs->session->handles[h].page; ++h);
+    if (h == SESSION_HANDLES) return -1;
+    handle = &fs->session->handles[h];
+    handle->page = fs_inode_page(fs, inode);
+    handle->dir = dir;
+    handle->dir_gen = fs_inode_gen(fs, dir);
+    handle->view = fs->view;
+    handle->removals = fs->removals;
+    handle->path = strdup(f);
+    return h;
+}
+
+int fs_close(FileSystem *fs, int h) {
+    if (h < 0 || h >= SESSION_HANDLES || !fs->session->handles[h].page) return ERROR;
+    free(fs->session->handles[h].path);
+    memset(&fs->session->handles[h], 0, sizeof(Handle));
     return OK;
 }
 
-enum { RESULT_EXIT, RESULT_DONE, RESULT_YES, RESULT_NO, RESULT_ELSE };
+// The file open as h, NULL when h is not open, the folder it was opened
+// in has been removed or its path names no file any more
+Inode* fs_handle(FileSystem *fs, int h) {
+    Handle *handle = NULL;
+    Inode *dir = NULL;
+    Inode *inode = NULL;
+    
+    if (h < 0 || h >= SESSION_HANDLES || !fs->session->handles[h].page) return NULL;
+    handle = &fs->session->handles[h];
+    if (handle->removals == fs->removals && handle->view == fs->view) {
+        fs->stats.handle_hits++;
+        return fs_load_inode(fs, handle->page);
+    }
+    fs->stats.handle_resolves++;
+    // once the folder is removed its page may name anything
+    if (handle->dir_gen != fs_inode_gen(fs, handle->dir)) return NULL;
+    dir = fs_load_inode(fs, handle->dir);
+    if (dir && dir->type == INODE_FOLDER) inode = folder_lookup(fs, dir, handle->path);
+    if (!inode || inode->type != INODE_FILE) return NULL;
+    handle->page = fs_inode_page(fs, inode);
+    handle->view = fs->view;
+    handle->removals = fs->removals;
+    return inode;
+}
 
 int process_request(const char *line, FILE *fp, FileSystem *fs) {
     char command[4096];
@@ -982,143 +3678,240 @@ int process_request(const char *line, FILE *fp, FileSystem *fs) {
 #ifdef DEBUG
     fprintf(stderr, "command is `%s`\n", command);
 #endif
+    // put f size, then size bytes of content; the reply comes after them
+    if (0 == strcmp("put", command)) {
+        char f[4096];
+        int size = 0;
+        
+        if (!fs->session || sscanf(line + 3, "%4095s %d", f, &size) != 2 || size < 0) return RESULT_NO;
+        fs_put_begin(fs, f, size, line);
+        return RESULT_ELSE;
+    }
+    // a mounted snapshot is read only
+    if (fs->view && (0 == strcmp("f", command) || 0 == strcmp("mk", command) || 0 == strcmp("mkdir", command)
+            || 0 == strcmp("rm", command) || 0 == strcmp("rmdir", command) || 0 == strcmp("w", command)
+            || 0 == strcmp("i", command) || 0 == strcmp("d", command) || 0 == strcmp("a", command)
+            || 0 == strcmp("hw", command) || 0 == strcmp("hi", command) || 0 == strcmp("hd", command)
+            || 0 == strcmp("ha", command))) {
+        return RESULT_NO;
+    }
     if (0 == strcmp("f", command)) {
-        fs_format(fs);
+        int size = 0;
+        int shift = fs->format_shift;
+        
+        // f [page_size], a power of two from 256 to 64K
+        if (sscanf(line + 1, "%d", &size) == 1) {
+            for (shift = PAGE_SHIFT_MIN; shift < PAGE_SHIFT_MAX && (1 << shift) < size; ++shift);
+            if (size != 1 << shift) return RESULT_NO;
+        }
+        if (fs_format(fs, shift, fs->format_itable) != OK) return RESULT_NO;
         return RESULT_DONE;
-    } else if (0 == strcmp("mk", command)) {
-        char f[4096];
-        char parent_path[4096];
+    } else if (0 == strcmp("mk", command) || 0 == strcmp("mkdir", command)) {
+        // mk path..., mkdir [-p] path...: each name must be new and the
+        // folder it goes in must exist; a request with several paths is
+        // answered with Yes or No for each
+        char f[4096] = "";
+        char *done = NULL;
+        FolderBatch batch;
+        const char *p = line + strlen(command);
+        int type = 0 == strcmp("mk", command) ? INODE_FILE : INODE_FOLDER;
+        int parents = 0;
+        int npath = 0;
+        int n = 0;
+        int i = 0;
         
-        sscanf(line + 2, "%s", f);
-#ifdef DEBUG
-        fprintf(stderr, "> mk `%s`\n", f);
-#endif
-        if (fs_exists(fs, f)) {
-#ifdef DEBUG
-            fprintf(stderr, "> `%s` already exists\n", f);
-#endif
-            return RESULT_NO;
-        } else {
-#ifdef DEBUG
-            fprintf(stderr, "> going to create `%s`\n", f);
-#endif
+        while (isspace((unsigned char) *p)) p++;
+        if (type == INODE_FOLDER && 0 == strncmp(p, "-p", 2) && (!p[2] || isspace((unsigned char) p[2]))) {
+            parents = 1;
+            p += 2;
         }
-        fs_split_path(f, parent_path, NULL);
-        if (fs_isdir(fs, parent_path)) {
-            if (fs_create(fs, f)) {
+        done = (char *) malloc(strlen(p) + 1);
+        folder_batch_init(&batch, fs);
+        while (sscanf(p, "%4095s%n", f, &n) == 1) {
 #ifdef DEBUG
-                fprintf(stderr, "> failed to create `%s`\n", f);
+            fprintf(stderr, "> going to create `%s`\n", f);
 #endif
-                return RESULT_NO;
-            }
-            return RESULT_YES;
+            done[npath++] = fs_make(fs, &batch, f, type, parents) == OK;
+            p += n;
         }
-#ifdef DEBUG
-        fprintf(stderr, "> parent path `%s` is not a directory\n", parent_path);
-#endif
-        return RESULT_NO;
-    } else if (0 == strcmp("mkdir", command)) {
-        char d[4096];
-        char parent_path[4096];
-        
-        sscanf(line + 5, "%s", d);
-        if (fs_exists(fs, d)) {
-            return RESULT_NO;
+        folder_batch_close(&batch);
+        if (npath <= 1) {
+            n = npath && done[0];
+            free(done);
+            return n ? RESULT_YES : RESULT_NO;
         }
-        fs_split_path(d, parent_path, NULL);
-        if (fs_isdir(fs, parent_path)) {
-            if (fs_mkdir(fs, d)) {
-                return RESULT_NO;
-            }
-            return RESULT_YES;
+        for (i = 0; i < npath; ++i) {
+            fprintf(fp, i ? " %s" : "%s", done[i] ? "Yes" : "No");
         }
-        return RESULT_NO;
+        fprintf(fp, "\n");
+        fflush(fp);
+        free(done);
+        return RESULT_ELSE;
     } else if (0 == strcmp("rm", command)) {
-        char f[4096];
+        char f[4096] = "";
+        Lookup lookup;
         
-        sscanf(line + 2, "%s", f);
-        if (fs_isfile(fs, f)) {
-            if (fs_unlink(fs, f)) {
-                return RESULT_NO;
-            }
-            return RESULT_YES;
-        }
-        return RESULT_NO;
+        sscanf(line + 2, "%4095s", f);
+        if (!fs_lookup(fs, f, &lookup) || lookup.inode->type != INODE_FILE || !lookup.parent) return RESULT_NO;
+        if (fs_unlink(fs, &lookup)) return RESULT_NO;
+        return RESULT_YES;
     } else if (0 == strcmp("cd", command)) {
-        char path[4096];
+        char path[4096] = "";
+        Lookup lookup;
         
-        sscanf(line + 2, "%s", path);
-        if (fs_isdir(fs, path)) {
-            if (fs_chdir(fs, path)) {
-                return RESULT_NO;
-            }
-            return RESULT_YES;
-        }
+        sscanf(line + 2, "%4095s", path);
+        if (!fs_lookup(fs, path, &lookup) || lookup.inode->type != INODE_FOLDER) {
 #ifdef DEBUG
-        fprintf(stderr, "`%s` is not a directory\n", path);
+            fprintf(stderr, "`%s` is not a directory\n", path);
 #endif
-        return RESULT_NO;
+            return RESULT_NO;
+        }
+        if (fs_chdir(fs, lookup.inode)) return RESULT_NO;
+        return RESULT_YES;
     } else if (0 == strcmp("rmdir", command)) {
-        char d[4096];
+        char d[4096] = "";
+        Lookup lookup;
         
-        sscanf(line + 5, "%s", d);
-        if (fs_isdir(fs, d)) {
-            if (fs_rmdir(fs, d)) {
-                return RESULT_NO;
-            }
-            return RESULT_YES;
-        }
-        return RESULT_NO;
+        sscanf(line + 5, "%4095s", d);
+        if (!fs_lookup(fs, d, &lookup) || lookup.inode->type != INODE_FOLDER) return RESULT_NO;
+        if (fs_rmdir(fs, &lookup)) return RESULT_NO;
+        return RESULT_YES;
     } else if (0 == strcmp("ls", command)) {
-        fs_ls(fs, fp);
+        int offset = 0;
+        int count = -1;
+        
+        sscanf(line + 2, "%d %d", &offset, &count);
+        fs_ls(fs, fp, offset, count);
         return RESULT_ELSE;
     } else if (0 == strcmp("cat", command)) {
-        char f[4096];
+        char f[4096] = "";
+        Inode *inode = NULL;
         
-        sscanf(line + 3, "%s", f);
-        if (fs_isfile(fs, f)) {
-            fs_cat(fs, f, fp);
-            return RESULT_ELSE;
-        }
-        return RESULT_NO;
+        sscanf(line + 3, "%4095s", f);
+        if (!(inode = fs_lookup_file(fs, f))) return RESULT_NO;
+        fs_cat(fs, inode, fp);
+        return RESULT_ELSE;
+    } else if (0 == strcmp("r", command)) {
+        char f[4096] = "";
+        int pos = 0;
+        int l = 0;
+        Inode *inode = NULL;
+        
+        // r f pos l, l bytes of f from pos on, replied as cat replies
+        if (sscanf(line + 1, "%4095s %d %d", f, &pos, &l) != 3 || !(inode = fs_lookup_file(fs, f))) return RESULT_NO;
+        fs_pread(fs, inode, pos, l, fp);
+        return RESULT_ELSE;
     } else if (0 == strcmp("w", command)) {
-        char f[4096];
-        int l;
-        char data[4096];
+        char f[4096] = "";
+        int l = 0;
+        char data[4096] = "";
+        Inode *inode = NULL;
         
-        sscanf(line + 1, "%s %d %[^\n]", f, &l, data);
-        if (fs_isfile(fs, f)) {
-            if (fs_write(fs, f, l, data)) {
-                return RESULT_NO;
-            }
-            return RESULT_YES;
-        }
-        return RESULT_NO;
+        sscanf(line + 1, "%4095s %d %4095[^\n]", f, &l, data);
+        if (l < 0 || l > (int) strlen(data)) return RESULT_NO;
+        if (!(inode = fs_lookup_file(fs, f)) || fs_write(fs, inode, l, data)) return RESULT_NO;
+        return RESULT_YES;
     } else if (0 == strcmp("i", command)) {
+        char f[4096] = "";
+        int pos = 0;
+        int l = 0;
+        char data[4096] = "";
+        Inode *inode = NULL;
+        
+        sscanf(line + 1, "%4095s %d %d %4095[^\n]", f, &pos, &l, data);
+        if (l < 0 || l > (int) strlen(data)) return RESULT_NO;
+        if (!(inode = fs_lookup_file(fs, f)) || fs_insert(fs, inode, pos, l, data)) return RESULT_NO;
+        return RESULT_YES;
+    } else if (0 == strcmp("d", command)) {
+        char f[4096] = "";
+        int pos = 0;
+        int l = 0;
+        Inode *inode = NULL;
+        
+        sscanf(line + 1, "%4095s %d %d", f, &pos, &l);
+        if (!(inode = fs_lookup_file(fs, f)) || fs_delete(fs, inode, pos, l)) return RESULT_NO;
+        return RESULT_YES;
+    } else if (0 == strcmp("a", command)) {
+        char f[4096] = "";
+        int l = 0;
+        char data[4096] = "";
+        Inode *inode = NULL;
+        
+        // a f l data, data added at the end of f
+        sscanf(line + 1, "%4095s %d %4095[^\n]", f, &l, data);
+        if (l < 0 || l > (int) strlen(data)) return RESULT_NO;
+        if (!(inode = fs_lookup_file(fs, f)) || fs_append(fs, inode, l, data)) return RESULT_NO;
+        return RESULT_YES;
+    } else if (0 == strcmp("open", command)) {
         char f[4096];
-        int pos;
-        int l;
-        char data[4096];
+        int h = -1;
         
-        sscanf(line + 1, "%s %d %d %[^\n]", f, &pos, &l, data);
-        if (fs_isfile(fs, f)) {
-            if (fs_insert(fs, f, pos, l, data)) {
-                return RESULT_NO;
-            }
-            return RESULT_YES;
+        // open f, replies the handle that stands for f in the h commands
+        if (!fs->session || sscanf(line + 4, "%4095s", f) != 1 || (h = fs_open(fs, f)) < 0) return RESULT_NO;
+        fprintf(fp, "%d\n", h);
+        fflush(fp);
+        return RESULT_ELSE;
+    } else if (0 == strcmp("close", command)) {
+        int h = -1;
+        
+        if (!fs->session || sscanf(line + 5, "%d", &h) != 1 || fs_close(fs, h)) return RESULT_NO;
+        return RESULT_YES;
+    } else if (fs->session && (0 == strcmp("hr", command) || 0 == strcmp("hw", command) || 0 == strcmp("hi", command)
+            || 0 == strcmp("hd", command) || 0 == strcmp("ha", command) || 0 == strcmp("hstat", command))) {
+        // hr, hw, hi, hd and ha take a handle where r, w, i, d and a take
+        // a path; hstat h replies the size of the file
+        int h = -1;
+        int pos = 0;
+        int l = 0;
+        char data[4096] = "";
+        const char *args = line + strlen(command);
+        Inode *inode = NULL;
+        
+        if (sscanf(args, "%d", &h) != 1 || !(inode = fs_handle(fs, h))) return RESULT_NO;
+        if (0 == strcmp("hr", command) && sscanf(args, "%*d %d %d", &pos, &l) == 2) {
+            fs_pread(fs, inode, pos, l, fp);
+            return RESULT_ELSE;
+        } else if (0 == strcmp("hw", command) && sscanf(args, "%*d %d %4095[^\n]", &l, data) >= 1) {
+            if (l < 0 || l > (int) strlen(data)) return RESULT_NO;
+            return fs_write(fs, inode, l, data) ? RESULT_NO : RESULT_YES;
+        } else if (0 == strcmp("hi", command) && sscanf(args, "%*d %d %d %4095[^\n]", &pos, &l, data) >= 2) {
+            if (l < 0 || l > (int) strlen(data)) return RESULT_NO;
+            return fs_insert(fs, inode, pos, l, data) ? RESULT_NO : RESULT_YES;
+        } else if (0 == strcmp("hd", command) && sscanf(args, "%*d %d %d", &pos, &l) == 2) {
+            return fs_delete(fs, inode, pos, l) ? RESULT_NO : RESULT_YES;
+        } else if (0 == strcmp("ha", command) && sscanf(args, "%*d %d %4095[^\n]", &l, data) >= 1) {
+            if (l < 0 || l > (int) strlen(data)) return RESULT_NO;
+            return fs_append(fs, inode, l, data) ? RESULT_NO : RESULT_YES;
+        } else if (0 == strcmp("hstat", command)) {
+            fprintf(fp, "%d\n", inode->filesize);
+            fflush(fp);
+            return RESULT_ELSE;
         }
         return RESULT_NO;
-    } else if (0 == strcmp("d", command)) {
-        char f[4096];
-        int pos;
-        int l;
+    } else if (0 == strcmp("stats", command)) {
+        stats_dump(&fs->stats, fp);
+        return RESULT_ELSE;
+    } else if (0 == strcmp("disks", command)) {
+        storage_dump(fs->stor, fp);
+        return RESULT_ELSE;
+    } else if (0 == strcmp("snapshot", command)) {
+        char op[16] = "";
+        char name[4096] = "";
+        Snapshot *snap = NULL;
         
-        sscanf(line + 1, "%s %d %d", f, &pos, &l);
-        if (fs_isfile(fs, f)) {
-            if (fs_delete(fs, f, pos, l)) {
-                return RESULT_NO;
-            }
+        // snapshot create|delete|mount name, snapshot list, snapshot umount
+        sscanf(line + 8, "%15s %4095s", op, name);
+        if (0 == strcmp("list", op)) {
+            snapshot_list(fs, fp);
+            return RESULT_ELSE;
+        } else if (0 == strcmp("umount", op) || (0 == strcmp("mount", op) && (snap = snapshot_find(fs->snapshots, name)))) {
+            fs_set_view(fs, snap ? snap->epoch : 0);
+            fs->cur = fs_load_inode(fs, ROOT_PAGE_NUM());
             return RESULT_YES;
+        } else if (!fs->view && 0 == strcmp("create", op)) {
+            return snapshot_create(fs, name) == OK ? RESULT_YES : RESULT_NO;
+        } else if (!fs->view && 0 == strcmp("delete", op)) {
+            return snapshot_delete(fs, name) == OK ? RESULT_YES : RESULT_NO;
         }
         return RESULT_NO;
     } else if (0 == strcmp("e", command)) {
@@ -1127,88 +3920,417 @@ int process_request(const char *line, FILE *fp, FileSystem *fs) {
     return RESULT_ELSE;
 }
 
+Session* session_new(int id, int sock, FileSystem *fs) {
+    Session *session = NULL;
+    cookie_io_functions_t io = { NULL, session_write, NULL, session_close };
+    
+    session = (Session *) malloc(sizeof(Session));
+    session->id = id;
+    session->sock = sock;
+    session->fp = fopencookie(session, "w", io);
+    session->cur = fs_load_inode(fs, ROOT_PAGE_NUM()) ? ROOT_PAGE_NUM() : -1;
+    session->cur_gen = fs_inode_gen(fs, session->cur);
+    session->view = 0;
+    memset(&session->upload, 0, sizeof(Upload));
+    memset(session->handles, 0, sizeof(session->handles));
+    session->nsent = 0;
+    session->len = 0;
+    return session;
+}
+
+void session_free(Session **session) {
+    if (session && *session) {
+        int i = 0;
+        
+        for (i = 0; i < SESSION_HANDLES; ++i) {
+            free((*session)->handles[i].path);
+        }
+        fclose((*session)->fp);
+        free(*session);
+        *session = NULL;
+    }
+}
+
+// Replies go through a stdio stream so process_request can fprintf them;
+// counting the bytes here lets the trace record how long each reply was.
+ssize_t session_write(void *cookie, const char *buf, size_t n) {
+    Session *session = (Session *) cookie;
+    
+    if (util_writen(session->sock, buf, n) < 0) return -1;
+    session->nsent += n;
+    return n;
+}
+
+// Writes all of iov to the socket, counted like what goes through fp
+int session_writev(Session *session, struct iovec *iov, int n) {
+    ssize_t k = 0;
+    
+    while (n > 0) {
+        if ((k = writev(session->sock, iov, n < IOV_MAX ? n : IOV_MAX)) <= 0) return -1;
+        session->nsent += k;
+        // skip what went out, a short write leaves part of an entry
+        while (n > 0 && (size_t) k >= iov->iov_len) {
+            k -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *) iov->iov_base + k;
+            iov->iov_len -= k;
+        }
+    }
+    return OK;
+}
+
+// Takes what has come of a put from the input buffer. Once all of it has,
+// the put is finished and answered like any request.
+void session_receive(Session *session, FileSystem *fs, Trace *trace) {
+    Upload *up = &session->upload;
+    int n = session->len < up->left ? session->len : up->left;
+    long long nsent = session->nsent;
+    int result = RESULT_NO;
+    
+    s_page_ops->receive(fs, up, session->buf, n);
+    if (trace) {
+        // replaying the put needs its content
+        if (!up->content) up->content = (char *) malloc(up->size + 1);
+        memcpy(up->content + up->size - up->left, session->buf, n);
+    }
+    up->left -= n;
+    session->len -= n;
+    memmove(session->buf, session->buf + n, session->len + 1);
+    if (up->left) return;
+    fs->cur = fs_load_inode(fs, session->cur);
+    if (fs_put_end(fs, up) == OK) result = RESULT_YES;
+    storage_sync(fs->stor);
+    stats_record(&fs->stats, up->line, result, util_now_us() - up->at);
+    fprintf(session->fp, RESULT_YES == result ? "Yes\n" : "No\n");
+    fflush(session->fp);
+    if (trace) {
+        trace_record(trace, session->id, up->at, up->line, strlen(up->line), session->nsent - nsent, up->content, up->size);
+    }
+    free(up->line);
+    free(up->content);
+    memset(up, 0, sizeof(Upload));
+}
+
+int session_close(void *cookie) {
+    return close(((Session *) cookie)->sock);
+}
+
+// Run every complete request in the input buffer. Returns RESULT_EXIT when
+// the client said goodbye and RESULT_DONE when it went away.
+int session_serve(Session *session, FileSystem *fs, Trace *trace) {
+    char *line = NULL;
+    char *end = NULL;
+    char *next = NULL;
+    int n = 0;
+    
+    n = recv(session->sock, session->buf + session->len, SESSION_BUFSIZE - 1 - session->len, 0);
+    if (n <= 0) {
+        printf("Client closed connection\n");
+        if (session->upload.active) {
+            fs_put_drop(fs, &session->upload);
+            free(session->upload.line);
+            free(session->upload.content);
+            session->upload.active = 0;
+        }
+        return RESULT_DONE;
+    }
+    session->len += n;
+    session->buf[session->len] = 0;
+    line = session->buf;
+    for (;;) {
+        int result;
+        double at = util_now_us();
+        long long nsent = session->nsent;
+        
+        if (session->upload.active) {
+            session_receive(session, fs, trace);
+            if (session->upload.active) break;
+            continue;
+        }
+        if (!(end = strchr(line, '\n')) && session->len < SESSION_BUFSIZE - 1) break;
+        if (end) {
+            *end = 0;
+        } else {
+            end = session->buf + session->len - 1;  // overlong request
+        }
+        next = end + 1;
+        while (end > line && isspace(end[-1])) {
+            *--end = 0;
+        }
+        printf("receive successfully\n");
+        if (fs_set_view(fs, session->view) != OK) {
+            // the snapshot it had mounted is gone
+            session->view = 0;
+            session->cur = ROOT_PAGE_NUM();
+        } else if (!session->view && (session->cur < 0 || session->cur_gen != fs_inode_gen(fs, session->cur))) {
+            // the volume had not been formatted, or its folder has been
+            // released since and the page may be reused
+            session->cur = ROOT_PAGE_NUM();
+        }
+        fs->cur = fs_load_inode(fs, session->cur);
+        fs->session = session;
+        result = process_request(line, session->fp, fs);
+        fs->session = NULL;
+        session->cur = fs->cur ? fs_inode_page(fs, fs->cur) : -1;
+        session->cur_gen = fs_inode_gen(fs, fs->view ? -1 : session->cur);
+        session->view = fs->view;
+        fs_set_view(fs, 0);
+        storage_sync(fs->stor);
+        storage_tick(fs->stor);
+        // a put is counted and traced once its content has come
+        if (!session->upload.active) {
+            stats_record(&fs->stats, line, result, util_now_us() - at);
+        }
+        if (RESULT_EXIT == result) {
+            fprintf(session->fp, "Goodbye!\n");
+            fflush(session->fp);
+            if (trace) {
+                trace_record(trace, session->id, at, line, end - line, session->nsent - nsent, NULL, 0);
+            }
+            return RESULT_EXIT;
+        } else if (RESULT_DONE == result) {
+            fprintf(session->fp, "Done\n");
+            fflush(session->fp);
+        } else if (RESULT_YES == result) {
+            fprintf(session->fp, "Yes\n");
+            fflush(session->fp);
+        } else if (RESULT_NO == result) {
+            fprintf(session->fp, "No\n");
+            fflush(session->fp);
+        }
+        printf("send succussfully.\n");
+        if (trace && !session->upload.active) {
+            trace_record(trace, session->id, at, line, end - line, session->nsent - nsent, NULL, 0);
+        }
+        // trimming may have moved end back, the next request starts after the newline
+        line = next;
+        if (line > session->buf + session->len) line = session->buf + session->len;
+        session->len -= line - session->buf;
+        memmove(session->buf, line, session->len + 1);
+        line = session->buf;
+    }
+    return RESULT_ELSE;
+}
+
+Trace* trace_open(const char *path) {
+    Trace *trace = NULL;
+    FILE *fp = NULL;
+    
+    if (!(fp = fopen(path, "wb"))) {
+        fprintf(stderr, "Cannot open trace %s\n", path);
+        return NULL;
+    }
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), fp);
+    trace = (Trace *) malloc(sizeof(Trace));
+    trace->fp = fp;
+    trace->last_us = -1;
+    trace->nrecord = 0;
+    return trace;
+}
+
+void trace_free(Trace **trace) {
+    if (trace && *trace) {
+        fclose((*trace)->fp);
+        printf("%lld requests traced\n", (*trace)->nrecord);
+        free(*trace);
+        *trace = NULL;
+    }
+}
+
+void trace_record(Trace *trace, int id, double at, const char *line, int len, int nreply, const char *payload, int npayload) {
+    char header[TRACE_HEADER];
+    double delta = 0;
+    
+    if (len >= TRACE_PAYLOAD) len = TRACE_PAYLOAD - 1;
+    if (trace->last_us >= 0 && at > trace->last_us) {
+        delta = at - trace->last_us;
+        if (delta > 0x7FFFFFFF) delta = 0x7FFFFFFF;
+    }
+    trace->last_us = at;
+    util_writeint(header, 0, (int) delta);
+    header[4] = id & 0xFF;
+    header[5] = (id >> 8) & 0xFF;
+    if (!line) {
+        len = TRACE_CLOSED;
+    } else if (payload) {
+        len |= TRACE_PAYLOAD;
+    }
+    header[6] = len & 0xFF;
+    header[7] = (len >> 8) & 0xFF;
+    util_writeint(header, 8, nreply);
+    fwrite(header, 1, TRACE_HEADER, trace->fp);
+    if (line) {
+        fwrite(line, 1, len & ~TRACE_PAYLOAD, trace->fp);
+        trace->nrecord++;
+    }
+    if (line && payload) {
+        util_writeint(header, 0, npayload);
+        fwrite(header, 1, 4, trace->fp);
+        fwrite(payload, 1, npayload, trace->fp);
+    }
+}
+
 int main(int argc, char **argv) {
     FileSystem *fs;
-    FILE* logfile;
-    char str[4096];
-    //char buffer[4096];
+    Storage *stor;
+    Session *sessions[SESSION_NUM];
+    int nsession = 0;
+    int nextid = 0;
+    Trace *trace = NULL;
+    double stats_every = 0;
+    double stats_at = 0;
+    double delay_us = 0;
+    int quit = 0;
     
-    int sd, client, diskserv;
-    struct sockaddr_in server_addr, name;
-    struct hostent *host;
+    int sd, client;
+    struct sockaddr_in server_addr;
+    int opt, stripe_unit = 4, mode = STORAGE_RAID0, route = ROUTE_QUEUE;
+    int page_size = SECTOR_SIZE, page_shift = PAGE_SHIFT_MIN, compress = 0, dedup = 0, inode_bytes = 0;
+    int one = 1;
+    int i = 0;
+    
+    while ((opt = getopt(argc, argv, "u:mr:t:s:p:i:zdw:")) != -1) {
+        if (opt == 's' && atof(optarg) > 0) {
+            stats_every = atof(optarg) * 1e6;
+        } else if (opt == 'w' && atof(optarg) > 0) {
+            delay_us = atof(optarg) * 1e3;
+        } else if (opt == 't') {
+            if (!(trace = trace_open(optarg))) exit(1);
+        } else if (opt == 'z') {
+            compress = 1;
+        } else if (opt == 'd') {
+            dedup = 1;
+        } else if (opt == 'p' && atoi(optarg) > 0) {
+            page_size = atoi(optarg);
+        } else if (opt == 'i' && atoi(optarg) >= SECTOR_SIZE) {
+            inode_bytes = atoi(optarg);
+        } else if (opt == 'u' && atoi(optarg) > 0) {
+            stripe_unit = atoi(optarg);
+        } else if (opt == 'm') {
+            mode = STORAGE_RAID1;
+        } else if (opt == 'r' && 0 == strcmp(optarg, "queue")) {
+            route = ROUTE_QUEUE;
+        } else if (opt == 'r' && 0 == strcmp(optarg, "seek")) {
+            route = ROUTE_SEEK;
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "Usage: %s [-t trace] [-s stats_seconds] [-p page_size] [-i bytes_per_inode] [-z] [-d] [-w delay_ms] [-u stripe_unit | -m [-r queue|seek]] diskport[,diskport...] port\n", argv[0]);
+        exit(1);
+    }
+    for (page_shift = PAGE_SHIFT_MIN; page_shift < PAGE_SHIFT_MAX && 1 << page_shift < page_size; ++page_shift);
+    if (1 << page_shift != page_size) {
+        fprintf(stderr, "Page size must be a power of two from %d to %d\n", 1 << PAGE_SHIFT_MIN, 1 << PAGE_SHIFT_MAX);
+        exit(1);
+    }
+    // a mirror that goes away must not take the server with it
+    signal(SIGPIPE, SIG_IGN);
     
-    // connect to disk server
-    if ((diskserv = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-		fprintf(stderr, "Socket error\n");
-		exit(1);
-	}
-	
+    // connect to disk servers
 	printf("Trying to connect...\n");
-	name.sin_family 	= AF_INET;
-	host				= gethostbyname("localhost"); 
-	name.sin_port		= htons(atoi(argv[1]));
-	memcpy(&name.sin_addr.s_addr, host->h_addr, host->h_length);
-	
-	if (connect(diskserv, (struct sockaddr *)&name, sizeof(name)) == -1) {
-		fprintf(stderr, "Connect error\n");
-		exit(1);
-	}	
-	printf("Connection with the disk is established!\n");	
-
-	// connect to client
+    stor = storage_open(argv[optind], mode, stripe_unit, route);
+
+	// serve clients
     sd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
     server_addr.sin_family		 = AF_INET;
     server_addr.sin_addr.s_addr  = htonl(INADDR_ANY);
-    server_addr.sin_port		 = htons(atoi(argv[2]));
+    server_addr.sin_port		 = htons(atoi(argv[optind + 1]));
     
     if (bind(sd, (struct sockaddr *) &server_addr, sizeof(server_addr)) == -1) {
     	fprintf(stderr, "Bind error\n");
     	exit(1);
     }
-    if (listen(sd, 1) == -1) {
+    if (listen(sd, SESSION_NUM) == -1) {
     	fprintf(stderr, "Listen error\n");
     	exit(1);
     }
-    fs = fs_new();
-    if ((client = accept(sd, 0, 0)) == -1) {
-    	fprintf(stderr, "Accept error\n");
-    	exit(1);
-    }
-    logfile = fdopen(client, "w+");
-    printf("Connection with client is established!\n");
-       
+    fs = fs_new(stor);
+    fs->format_shift = page_shift;
+    fs->format_itable = inode_bytes;
+    fs->compress = compress;
+    fs->dedup = dedup;
+    fs->delay_us = delay_us;
+    fs->sessions = sessions;
     
-    while (1) {
-        int result;
+    // The server goes down once a client has said goodbye and every other
+    // client has gone
+    while (!quit || nsession) {
+        fd_set fds;
+        struct timeval timeout;
+        int maxfd = sd;
         
-        recv(client, str, 4096, 0);
-        while (isspace(str[strlen(str) - 1])) {
-            str[strlen(str) - 1] = 0;
+        FD_ZERO(&fds);
+        if (!quit) FD_SET(sd, &fds);
+        for (i = 0; i < nsession; ++i) {
+            FD_SET(sessions[i]->sock, &fds);
+            if (sessions[i]->sock > maxfd) maxfd = sessions[i]->sock;
         }
-        printf("receive successfully\n");
-        result = process_request(str, logfile, fs);
-        if (RESULT_EXIT == result) {
-            fprintf(logfile, "Goodbye!\n");
-            fflush(logfile);
-            break;
-        } else if (RESULT_DONE == result) {
-            fprintf(logfile, "Done\n");
-            fflush(logfile);
-        } else if (RESULT_YES == result) {
-            fprintf(logfile, "Yes\n");
-            fflush(logfile);
-        } else if (RESULT_NO == result) {
-            fprintf(logfile, "No\n");
-            fflush(logfile);
+        if (stats_every && util_now_us() >= stats_at) {
+            if (stats_at) stats_dump(&fs->stats, stdout);
+            stats_at = util_now_us() + stats_every;
+        }
+        // removed trees are freed a batch at a time between requests
+        if (fs_reclaim(fs, RECLAIM_BATCH)) {
+            storage_sync(fs->stor);
+        }
+        // and folders with many removed items compacted
+        if (!fs->nreclaim && fs_compact(fs)) {
+            storage_sync(fs->stor);
+        }
+        if (fs->ndelayed && util_now_us() >= fs->delayed_at + fs->delay_us) {
+            fs_flush(fs);
+            storage_sync(fs->stor);
+        }
+        timeout.tv_sec = 0;
+        timeout.tv_usec = fs->nreclaim || fs->ncompact ? 0 : 100000;
+        if (fs->ndelayed && fs->delayed_at + fs->delay_us - util_now_us() < timeout.tv_usec) {
+            timeout.tv_usec = fs->delayed_at + fs->delay_us - util_now_us();
+            if (timeout.tv_usec < 0) timeout.tv_usec = 0;
+        }
+        if (select(maxfd + 1, &fds, NULL, NULL, &timeout) <= 0) {
+            storage_tick(fs->stor);
+            continue;
+        }
+        if (!quit && FD_ISSET(sd, &fds)) {
+            if ((client = accept(sd, 0, 0)) == -1) {
+                fprintf(stderr, "Accept error\n");
+            } else if (nsession == SESSION_NUM) {
+                close(client);
+            } else {
+                setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                sessions[nsession++] = session_new(nextid++ & 0xFFFF, client, fs);
+                fs->nsession = nsession;
+                printf("Connection with client is established!\n");
+            }
+        }
+        for (i = 0; i < nsession; ++i) {
+            int result = RESULT_ELSE;
+            
+            if (FD_ISSET(sessions[i]->sock, &fds)) {
+                result = session_serve(sessions[i], fs, trace);
+            }
+            if (RESULT_EXIT == result || RESULT_DONE == result) {
+                if (RESULT_EXIT == result) quit = 1;
+                if (trace) {
+                    trace_record(trace, sessions[i]->id, util_now_us(), NULL, 0, 0, NULL, 0);
+                }
+                session_free(&sessions[i]);
+                sessions[i--] = sessions[--nsession];
+                fs->nsession = nsession;
+            }
         }
-        printf("send succussfully.\n");
     }
-    close(client);
-    close(diskserv);
     close(sd);
     printf("GoodBye!\n");
+    trace_free(&trace);
     fs_free(&fs);
-    fclose(logfile);
     return 0;
 }
 
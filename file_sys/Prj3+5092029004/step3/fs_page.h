@@ -0,0 +1,310 @@
+// Page size specific chain routines. fs.c includes this file once for every
+// supported page size, with PAGE_SHIFT set to log2 of the size, and picks
+// the instance matching the volume at mount time. Page sizes and offsets
+// are compile time constants here, so walking a chain needs no division
+// and no copy through a bounce buffer.
+
+#define PAGE_BYTES (1 << PAGE_SHIFT)
+#define PAGE_CONTENT (PAGE_BYTES - 4)
+// inodes in a table hold no content
+#define PAGE_INLINE (s_itable_pages ? 0 : PAGE_CONTENT - INODE_INLINE_OFFSET)
+#define PAGE_SECTORS (1 << (PAGE_SHIFT - SECTOR_SHIFT))
+
+static char* PAGE_FN(page_at)(Storage *stor, int page_num) {
+    return storage_pages(stor, page_num << (PAGE_SHIFT - SECTOR_SHIFT), PAGE_SECTORS);
+}
+
+static void PAGE_FN(page_dirty)(Storage *stor, int page_num) {
+    storage_mark_dirty_pages(stor, page_num << (PAGE_SHIFT - SECTOR_SHIFT), PAGE_SECTORS);
+}
+
+// Copies len bytes from offset of what the file stores. Whole pages before
+// offset are skipped through their next pointers without being copied.
+static void PAGE_FN(chain_read)(File *file, char *buf, int offset, int len) {
+    Storage *stor = file->fs->stor;
+    int page = file->inode->firstpage;
+    int done = 0;
+
+    if (!page) {
+        if (!len || offset + len > PAGE_INLINE) return;
+        memcpy(buf, PAGE_FN(page_at)(stor, file->inode->page_num) + INODE_INLINE_OFFSET + offset, len);
+        return;
+    }
+    for (; page && offset >= PAGE_CONTENT; offset -= PAGE_CONTENT) {
+        page = util_readint(PAGE_FN(page_at)(stor, page), PAGE_CONTENT);
+    }
+    while (page && done < len) {
+        char *data = PAGE_FN(page_at)(stor, page);
+        int n = PAGE_CONTENT - offset;
+
+        if (n > len - done) n = len - done;
+        memcpy(buf + done, data + offset, n);
+        done += n;
+        offset = 0;
+        page = util_readint(data, PAGE_CONTENT);
+    }
+}
+
+// Replaces what the file stores with buf, in the inode page when it fits.
+// Returns ERROR, leaving nothing stored, when the volume has no room.
+static int PAGE_FN(chain_write)(File *file, const char *buf, int buflen) {
+    Storage *stor = file->fs->stor;
+    Freelist *freelist = file->fs->freelist;
+    Inode *inode = file->inode;
+    int dedup = file->fs->dedup && inode->type == INODE_FILE;
+    int page = 0;
+    int npage = 0;
+    int nkeep = 0;
+    int nextpage = 0;
+    int len = 0;
+    int i = 0;
+
+    npage = buflen <= PAGE_INLINE ? 0 : (buflen + PAGE_CONTENT - 1) / PAGE_CONTENT;
+    // the leading pages of the old chain that no other chain or snapshot
+    // holds are written over in place; the rest of it is released
+    page = inode->firstpage;
+    while (!dedup && page && nkeep < npage && freelist->refs[page] == 1) {
+        page = util_readint(PAGE_FN(page_at)(stor, page), PAGE_CONTENT);
+        nkeep++;
+    }
+    if (npage - nkeep > freelist_room(freelist)) {
+        page = inode->firstpage;
+        nkeep = 0;
+    }
+    while (page) {
+        int next = util_readint(PAGE_FN(page_at)(stor, page), PAGE_CONTENT);
+
+        // a page another chain still uses keeps the rest of the chain too
+        if (!freelist_release(freelist, page)) break;
+        page = next;
+    }
+    if (!nkeep) inode->firstpage = inode->lastpage = 0;
+    if (!npage) {
+        if (!buflen) return OK;
+        snapshot_cow(file->fs, inode->page_num);
+        memcpy(PAGE_FN(page_at)(stor, inode->page_num) + INODE_INLINE_OFFSET, buf, buflen);
+        PAGE_FN(page_dirty)(stor, inode->page_num);
+        return OK;
+    }
+    if (npage - nkeep > freelist_room(freelist)) return ERROR;
+    if (dedup) {
+        // a page's image names the next one, so the chain is built from its tail
+        for (i = npage - 1; i >= 0; --i) {
+            char image[PAGE_BYTES];
+
+            len = buflen - i * PAGE_CONTENT;
+            if (len > PAGE_CONTENT) len = PAGE_CONTENT;
+            memcpy(image, buf + i * PAGE_CONTENT, len);
+            memset(image + len, 0, PAGE_CONTENT - len);
+            util_writeint(image, PAGE_CONTENT, nextpage);
+            page = dedup_page(file->fs, image, nextpage ? nextpage : INODE_PAGE(inode->page_num));
+            if (i == npage - 1) inode->lastpage = page;
+            nextpage = page;
+        }
+        inode->firstpage = nextpage;
+        return OK;
+    }
+    // the kept pages come first; every page added is taken right after the
+    // one before it, starting at the inode, so the chain runs forward over
+    // as few cylinders as it can
+    if (!nkeep) inode->firstpage = freelist_allocate(freelist, INODE_PAGE(inode->page_num));
+    page = inode->firstpage;
+    for (i = 0; i < npage; ++i) {
+        char *data = PAGE_FN(page_at)(stor, page);
+
+        len = buflen - i * PAGE_CONTENT;
+        if (len > PAGE_CONTENT) len = PAGE_CONTENT;
+        if (i + 1 < nkeep) {
+            nextpage = util_readint(data, PAGE_CONTENT);
+        } else {
+            nextpage = i + 1 < npage ? freelist_allocate(freelist, page) : 0;
+        }
+        memcpy(data, buf + i * PAGE_CONTENT, len);
+        memset(data + len, 0, PAGE_CONTENT - len);
+        util_writeint(data, PAGE_CONTENT, nextpage);
+        PAGE_FN(page_dirty)(stor, page);
+        if (!nextpage) inode->lastpage = page;
+        page = nextpage;
+    }
+    file->fs->stats.pages_reused += nkeep;
+    return OK;
+}
+
+// Adds len bytes after what the file stores: the rest of the last page is
+// filled and new pages are linked behind it, no other page is read. The
+// caller makes sure the last page is the file's alone. Returns ERROR,
+// with the file as it was, when the volume has no room.
+static int PAGE_FN(chain_append)(File *file, const char *buf, int len) {
+    Storage *stor = file->fs->stor;
+    Inode *inode = file->inode;
+    int tail = inode->lastpage;
+    int room = 0;
+    int done = 0;
+    
+    if (!len) return OK;
+    if (!inode->firstpage) {
+        char *all = NULL;
+        int result = OK;
+        
+        if (inode->stored + len <= PAGE_INLINE) {
+            snapshot_cow(file->fs, inode->page_num);
+            memcpy(PAGE_FN(page_at)(stor, inode->page_num) + INODE_INLINE_OFFSET + inode->stored, buf, len);
+            PAGE_FN(page_dirty)(stor, inode->page_num);
+            return OK;
+        }
+        // outgrows the inode page, at most a page is copied
+        if ((inode->stored + len + PAGE_CONTENT - 1) / PAGE_CONTENT > freelist_room(file->fs->freelist)) return ERROR;
+        all = (char *) malloc(inode->stored + len);
+        if (inode->stored) memcpy(all, PAGE_FN(page_at)(stor, inode->page_num) + INODE_INLINE_OFFSET, inode->stored);
+        memcpy(all + inode->stored, buf, len);
+        result = PAGE_FN(chain_write)(file, all, inode->stored + len);
+        free(all);
+        return result;
+    }
+    if (inode->stored % PAGE_CONTENT) room = PAGE_CONTENT - inode->stored % PAGE_CONTENT;
+    if (len > room && (len - room + PAGE_CONTENT - 1) / PAGE_CONTENT > freelist_room(file->fs->freelist)) return ERROR;
+    if (room) {
+        done = len < room ? len : room;
+        memcpy(PAGE_FN(page_at)(stor, tail) + PAGE_CONTENT - room, buf, done);
+        PAGE_FN(page_dirty)(stor, tail);
+    }
+    while (done < len) {
+        int page = freelist_allocate(file->fs->freelist, tail);
+        char *data = PAGE_FN(page_at)(stor, page);
+        int n = len - done < PAGE_CONTENT ? len - done : PAGE_CONTENT;
+        
+        memcpy(data, buf + done, n);
+        memset(data + n, 0, PAGE_CONTENT - n);
+        util_writeint(data, PAGE_CONTENT, 0);
+        PAGE_FN(page_dirty)(stor, page);
+        util_writeint(PAGE_FN(page_at)(stor, tail), PAGE_CONTENT, page);
+        PAGE_FN(page_dirty)(stor, tail);
+        tail = page;
+        done += n;
+    }
+    inode->lastpage = tail;
+    return OK;
+}
+
+// Writes len bytes over what the file stores at offset, only the pages
+// they fall in are written. Returns ERROR, with nothing written, when one
+// of them is shared with another chain or a snapshot.
+static int PAGE_FN(chain_patch)(File *file, int offset, const char *buf, int len) {
+    Storage *stor = file->fs->stor;
+    Freelist *freelist = file->fs->freelist;
+    int page = file->inode->firstpage;
+    int first = 0;
+    int covered = 0;
+    int done = 0;
+
+    if (!page) {
+        if (offset + len > PAGE_INLINE) return ERROR;
+        snapshot_cow(file->fs, file->inode->page_num);
+        memcpy(PAGE_FN(page_at)(stor, file->inode->page_num) + INODE_INLINE_OFFSET + offset, buf, len);
+        PAGE_FN(page_dirty)(stor, file->inode->page_num);
+        return OK;
+    }
+    for (; page && offset >= PAGE_CONTENT; offset -= PAGE_CONTENT) {
+        page = util_readint(PAGE_FN(page_at)(stor, page), PAGE_CONTENT);
+    }
+    for (first = page, covered = PAGE_CONTENT - offset; page; covered += PAGE_CONTENT) {
+        if (freelist->refs[page] != 1) return ERROR;
+        if (covered >= len) break;
+        page = util_readint(PAGE_FN(page_at)(stor, page), PAGE_CONTENT);
+    }
+    if (!page) return ERROR;
+    for (page = first; done < len; offset = 0) {
+        char *data = PAGE_FN(page_at)(stor, page);
+        int n = PAGE_CONTENT - offset;
+
+        if (n > len - done) n = len - done;
+        dedup_forget(freelist, page);
+        memcpy(data + offset, buf + done, n);
+        PAGE_FN(page_dirty)(stor, page);
+        done += n;
+        page = util_readint(data, PAGE_CONTENT);
+    }
+    return OK;
+}
+
+// The last page of the chain, for inodes that do not record it
+static int PAGE_FN(chain_tail)(File *file) {
+    Storage *stor = file->fs->stor;
+    int page = file->inode->firstpage;
+    int next = 0;
+    
+    while (page && (next = util_readint(PAGE_FN(page_at)(stor, page), PAGE_CONTENT))) page = next;
+    return page;
+}
+
+// Hands the content to fs_reply as iovecs over the pages themselves,
+// REPLY_IOV pages at a time
+static void PAGE_FN(chain_send)(File *file, FILE *fp) {
+    Storage *stor = file->fs->stor;
+    struct iovec iov[REPLY_IOV];
+    int page = file->inode->firstpage;
+    int left = file->inode->filesize;
+    int n = 0;
+    
+    if (!page) {
+        if (!left) return;
+        iov[0].iov_base = PAGE_FN(page_at)(stor, file->inode->page_num) + INODE_INLINE_OFFSET;
+        iov[0].iov_len = left;
+        fs_reply(file->fs, fp, iov, 1);
+        return;
+    }
+    while (page && left > 0) {
+        char *data = PAGE_FN(page_at)(stor, page);
+        
+        iov[n].iov_base = data;
+        iov[n].iov_len = left < PAGE_CONTENT ? left : PAGE_CONTENT;
+        left -= iov[n].iov_len;
+        if (++n == REPLY_IOV) {
+            fs_reply(file->fs, fp, iov, n);
+            n = 0;
+        }
+        page = util_readint(data, PAGE_CONTENT);
+    }
+    if (n) fs_reply(file->fs, fp, iov, n);
+}
+
+// Copies n bytes of a put into its chain, allocating and linking pages as
+// they fill. Stops taking pages when the volume is full.
+static void PAGE_FN(chain_receive)(FileSystem *fs, Upload *up, const char *buf, int n) {
+    Storage *stor = fs->stor;
+    int done = 0;
+    
+    while (done < n && !up->failed) {
+        int k = 0;
+        
+        if (!up->last || up->used == PAGE_CONTENT) {
+            int page = freelist_allocate(fs->freelist, up->last ? up->last : up->near);
+            
+            if (page < 0) {
+                up->failed = 1;
+                break;
+            }
+            memset(PAGE_FN(page_at)(stor, page), 0, PAGE_BYTES);
+            PAGE_FN(page_dirty)(stor, page);
+            if (up->last) {
+                util_writeint(PAGE_FN(page_at)(stor, up->last), PAGE_CONTENT, page);
+                PAGE_FN(page_dirty)(stor, up->last);
+            } else {
+                up->first = page;
+            }
+            up->last = page;
+            up->used = 0;
+        }
+        k = n - done < PAGE_CONTENT - up->used ? n - done : PAGE_CONTENT - up->used;
+        memcpy(PAGE_FN(page_at)(stor, up->last) + up->used, buf + done, k);
+        PAGE_FN(page_dirty)(stor, up->last);
+        up->used += k;
+        done += k;
+    }
+}
+
+#undef PAGE_BYTES
+#undef PAGE_CONTENT
+#undef PAGE_INLINE
+#undef PAGE_SECTORS
+#undef PAGE_SHIFT
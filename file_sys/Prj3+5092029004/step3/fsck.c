@@ -0,0 +1,758 @@
+/*****************************************************************
+* Consistency checker for fs volumes.
+*
+* Works on the disk images directly, so the disk and fs servers must
+* be down. Images of a striped volume are given in the order their
+* disk servers were passed to fs, with the same stripe unit.
+*
+* The page size comes from the superblock in page 0; a volume without
+* one has the 256 byte pages and layout of the first fs versions.
+*
+* Checks, following the layout in fs.c:
+*   - every inode reached from the root has INODE_MAGIC_NUMBER in the
+*     last 4 bytes of its page, or of its slot on volumes with an inode
+*     table, and a known type
+*   - page chains stay inside the volume, never run into the free map,
+*     the root or the inode table, and no page belongs to two chains
+*   - filesize matches the length of the chain, or fits in the inode
+*     page for a file stored inline; for a compressed file the stored
+*     size does, the content itself is not decompressed
+*   - on volumes that record it, the last page an inode names is where
+*     its chain ends
+*   - directory contents parse, "" is the root, "." is the directory
+*     itself, ".." is a directory, every other item points to a
+*     valid inode of the type it records, and no inode is named twice
+*   - no inode table slot holds an inode nothing names
+*   - the free map holds for every page how many references reach it,
+*     an inode or a page pointing to it; more than one for the pages
+*     fs -d stores once for several files
+*   - the snapshot table named in the superblock and the bitmap file of
+*     every snapshot are sound; each page a snapshot sees, through the
+*     copies made for it, carries one more reference in the free map
+*
+* Directories and files are checked by a pool of threads sharing one
+* work queue; a page is claimed with an atomic increment, so the first
+* chain that reaches a page owns it and any later one is cross-linked,
+* unless the free map counts it as shared. A shared page is counted by
+* every chain reaching it, the rest of the chain only by the first.
+* With -r the problems are repaired afterwards on a single thread: bad
+* items are dropped from their directory, chains are cut where they
+* go wrong with filesize adjusted to match, and the free map is
+* rebuilt from what is reachable. A compressed file with a broken chain
+* cannot be cut short, it is emptied instead.
+*
+* With -c, the sectors per cylinder the disk servers were started
+* with, it also reports how far the disk heads travel to read a file
+* from its inode to the end of its chain, on average over the files
+* stored in a chain.
+*
+* Exit status is 0 for a clean volume, 1 when errors were repaired and
+* 4 when errors were left.
+******************************************************************/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SECTOR_SIZE			(256)
+#define SUPER_MAGIC			(0x46535342)
+#define PAGE_SHIFT_MAX		(16)
+#define FEATURE_ENCODING	(1)		/* inodes hold an encoding and a stored size */
+#define FEATURE_TAIL		(2)		/* inodes with a chain hold its last page inline */
+#define ENCODING_LZ			(1)
+#define INODE_MAGIC			(0xCAFE)
+#define INLINE_OFFSET		(20)	/* small files live in their inode page */
+#define INODE_FILE			(0)
+#define INODE_FOLDER		(1)
+#define ITEM_TYPE_SHIFT		(24)
+#define ITEM_LEN_MASK		((1 << ITEM_TYPE_SHIFT) - 1)
+#define MAX_IMAGES			(8)
+#define MAX_THREADS			(64)
+#define MAX_REPORTS			(10)	/* messages printed per kind of error */
+#define REFS_MAX			(255)	/* a free map byte counts the references to its page */
+#define SUPER_SNAPSHOTS		(16)	/* superblock offset of the snapshot table inode */
+#define SUPER_ITABLE		(20)	/* and of the pages in the inode table */
+#define FEATURE_ITABLE		(4)		/* inodes are numbered slots of a table after the free map */
+#define SLOT_BYTES			(28)
+#define SLOT_MAGIC			(24)
+#define FEATURE_FOLDER_LOG	(8)		/* folder items run to the end, removed ones name page 0 */
+
+enum { ERR_INODE, ERR_CHAIN, ERR_CROSS, ERR_SIZE, ERR_DIR, ERR_TYPE, ERR_LEAK, ERR_FREE, ERR_REFS, ERR_SNAP,
+	ERR_TAIL, ERR_ILEAK, ERR_NUM };
+
+const char *err_names[ERR_NUM] = {
+	"bad inodes", "broken chains", "cross-linked pages", "wrong sizes",
+	"bad directory items", "wrong item types", "leaked pages", "used pages marked free",
+	"wrong reference counts", "bad snapshot files", "wrong last pages", "leaked inodes"
+};
+
+/* a page of the tree as it was when a later snapshot was taken */
+typedef struct {
+	int page, copy, epoch;
+} Copy;
+
+/* a directory to rewrite with the items that survived, or a chain to cut */
+typedef struct Fix {
+	int inode;
+	int filesize;
+	int last;		/* last page kept in the chain, 0 for none */
+	int drop;		/* free the chain up to last, the file becomes empty */
+	char *content;	/* new directory content, or NULL */
+	struct Fix *next;
+} Fix;
+
+typedef struct {
+	char *images[MAX_IMAGES];
+	int nimage;
+	int stripe_unit;
+	int num_sector;	/* sectors per cylinder, 0 without -c */
+	int page_size, content_bytes, inline_bytes;
+	int shift;		/* log2 of the sectors in a page */
+	int npage, freemap_first, freemap_pages, root;
+	int features;
+	int itable_first, itable_pages, slots, nslot;	/* no pages without an inode table */
+	int magic_offset;	/* of the magic within an inode */
+	int data_first;		/* the pages before are never free */
+	unsigned short *claimed;	/* per page, the references the walk found */
+	unsigned short *iclaimed;	/* per inode table slot, the names the walk found */
+	unsigned short *pins;		/* per page, the snapshots that see it */
+
+	pthread_mutex_t lock;
+	pthread_cond_t more;
+	int *queue;
+	int nqueue, cap, busy;
+
+	long long errors[ERR_NUM];
+	long long ninode, nfolder, nused;
+	long long nchained, seek_cylinders, seek_pages;
+	Fix *fixes;
+} Volume;
+
+Volume vol;
+
+double now_us() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+/* same mapping as storage_map in fs.c; main makes sure the sectors of a
+   page are all on one image */
+char *page(int p) {
+	long long s = (long long) p << vol.shift;
+	long long unit = s / vol.stripe_unit;
+	int member = unit % vol.nimage;
+	long long sector = unit / vol.nimage * vol.stripe_unit + s % vol.stripe_unit;
+	return vol.images[member] + sector * SECTOR_SIZE;
+}
+
+/* The image a page is on, and its cylinder there through *cyl */
+int cylinder(int p, long long *cyl) {
+	long long s = (long long) p << vol.shift;
+	long long unit = s / vol.stripe_unit;
+	*cyl = (unit / vol.nimage * vol.stripe_unit + s % vol.stripe_unit) / vol.num_sector;
+	return unit % vol.nimage;
+}
+
+int getint(int p, int offset) {
+	int v;
+	memcpy(&v, page(p) + offset, 4);
+	return v;
+}
+
+void setint(int p, int offset, int v) {
+	memcpy(page(p) + offset, &v, 4);
+}
+
+void report(int kind, const char *fmt, ...) {
+	va_list ap;
+	long long n = __atomic_add_fetch(&vol.errors[kind], 1, __ATOMIC_RELAXED);
+	if (n > MAX_REPORTS) return;
+	pthread_mutex_lock(&vol.lock);
+	va_start(ap, fmt);
+	vfprintf(stdout, fmt, ap);
+	va_end(ap);
+	fputc('\n', stdout);
+	pthread_mutex_unlock(&vol.lock);
+}
+
+int reserved(int p) {
+	/* the superblock, the free map and the root inode or the inode table */
+	return p < vol.data_first;
+}
+
+/* Returns 1 when the caller is the first to reach the page */
+int claim(int p) {
+	return __atomic_fetch_add(&vol.claimed[p], 1, __ATOMIC_RELAXED) == 0;
+}
+
+/* An inode is a page, or with an inode table a slot of one of its pages */
+int inode_page(int i) {
+	return vol.itable_pages ? vol.itable_first + i / vol.slots : i;
+}
+
+char *inode_at(int i) {
+	return vol.itable_pages ? page(inode_page(i)) + i % vol.slots * SLOT_BYTES : page(i);
+}
+
+int iget(int i, int offset) {
+	int v;
+	memcpy(&v, inode_at(i) + offset, 4);
+	return v;
+}
+
+void iset(int i, int offset, int v) {
+	memcpy(inode_at(i) + offset, &v, 4);
+}
+
+/* Returns 1 when the caller is the first to reach the inode */
+int claim_inode(int i) {
+	if (!vol.itable_pages) return claim(i);
+	return __atomic_fetch_add(&vol.iclaimed[i], 1, __ATOMIC_RELAXED) == 0;
+}
+
+unsigned char *refs(int p) {
+	return (unsigned char *) page(vol.freemap_first + p / vol.page_size) + p % vol.page_size;
+}
+
+void add_fix(int inode, int filesize, int last, int drop, char *content) {
+	Fix *fix = malloc(sizeof(Fix));
+	fix->inode = inode;
+	fix->filesize = filesize;
+	fix->last = last;
+	fix->drop = drop;
+	fix->content = content;
+	pthread_mutex_lock(&vol.lock);
+	fix->next = vol.fixes;
+	vol.fixes = fix;
+	pthread_mutex_unlock(&vol.lock);
+}
+
+void push(int *items, int n) {
+	if (!n) return;
+	pthread_mutex_lock(&vol.lock);
+	if (vol.nqueue + n > vol.cap) {
+		while (vol.nqueue + n > vol.cap) vol.cap = vol.cap ? vol.cap * 2 : 1024;
+		vol.queue = realloc(vol.queue, sizeof(int) * vol.cap);
+	}
+	memcpy(vol.queue + vol.nqueue, items, sizeof(int) * n);
+	vol.nqueue += n;
+	pthread_cond_broadcast(&vol.more);
+	pthread_mutex_unlock(&vol.lock);
+}
+
+int encoded(int p) {
+	return (vol.features & FEATURE_ENCODING) && iget(p, 8) == ENCODING_LZ;
+}
+
+/* bytes in the chain or inline */
+int stored_size(int p) {
+	return (vol.features & FEATURE_ENCODING) ? iget(p, 12) : iget(p, 4);
+}
+
+int valid_inode(int p) {
+	int type;
+	if (vol.itable_pages ? p <= 0 || p >= vol.nslot : p <= 0 || p >= vol.npage || (reserved(p) && p != vol.root)) return 0;
+	if (iget(p, vol.magic_offset) != INODE_MAGIC) return 0;
+	type = iget(p, 0);
+	return (type == INODE_FILE || type == INODE_FOLDER) && iget(p, 4) >= 0
+		&& stored_size(p) >= 0 && stored_size(p) / vol.content_bytes < vol.npage;
+}
+
+/* Walks and claims the chain of an inode and returns how many bytes of
+   it can be trusted. A folder passes buf to get its content and repairs
+   the chain itself when rewriting the content, so *broken tells it. */
+int check_chain(int inode, char *buf, int *broken) {
+	int filesize = stored_size(inode), p = iget(inode, 16);
+	int want = (filesize + vol.content_bytes - 1) / vol.content_bytes, n = 0, last = 0, owned = 1;
+
+	if (!p && filesize <= vol.inline_bytes) {
+		if (buf) memcpy(buf, inode_at(inode) + INLINE_OFFSET, filesize);
+		*broken = 0;
+		return filesize;
+	}
+	while (p && n < want) {
+		if (p < 0 || p >= vol.npage || reserved(p)) {
+			report(ERR_CHAIN, "inode %d: page %d of its chain is outside the data area", inode, p);
+			break;
+		}
+		if (owned && !claim(p)) {
+			if (*refs(p) - vol.pins[p] <= 1) {
+				report(ERR_CROSS, "inode %d: page %d is already used elsewhere", inode, p);
+				break;
+			}
+			/* a shared tail, the chain that got here first checks it */
+			owned = 0;
+		}
+		if (buf) memcpy(buf + n * vol.content_bytes, page(p), vol.content_bytes);
+		last = p;
+		n++;
+		p = getint(p, vol.content_bytes);
+	}
+	*broken = n != want || p;
+	if (n == want && p) {
+		report(ERR_SIZE, "inode %d: chain is longer than its %d bytes", inode, filesize);
+	} else if (n < want) {
+		if (!p) report(ERR_SIZE, "inode %d: chain has %d pages for %d bytes", inode, n, filesize);
+		filesize = n * vol.content_bytes;
+	}
+	if (*broken && !buf && encoded(inode)) add_fix(inode, 0, last, 1, NULL);
+	else if (*broken && !buf) add_fix(inode, filesize, last, 0, NULL);
+	else if ((vol.features & FEATURE_TAIL) && iget(inode, INLINE_OFFSET) != last) {
+		report(ERR_TAIL, "inode %d: names page %d as its last, the chain ends at %d",
+			inode, iget(inode, INLINE_OFFSET), last);
+		/* the chain itself is sound, rewriting it in place records the end */
+		if (buf) *broken = 1;
+		else add_fix(inode, filesize, last, 0, NULL);
+	}
+	return filesize;
+}
+
+/* Adds the cylinders crossed reading a file, its inode and then its chain
+   in order, to the seek totals. Every disk has its own head, which starts
+   on its first page without moving. */
+void seek_distance(int inode) {
+	long long head[MAX_IMAGES], cyl, dist = 0;
+	int p = iget(inode, 16), n = 0, m;
+
+	if (!p) return;
+	for (m = 0; m < vol.nimage; m++) head[m] = -1;
+	m = cylinder(inode_page(inode), &cyl);
+	head[m] = cyl;
+	for (; p > 0 && p < vol.npage && !reserved(p) && n < vol.npage; p = getint(p, vol.content_bytes)) {
+		m = cylinder(p, &cyl);
+		if (head[m] >= 0) dist += cyl > head[m] ? cyl - head[m] : head[m] - cyl;
+		head[m] = cyl;
+		n++;
+	}
+	__atomic_add_fetch(&vol.nchained, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&vol.seek_cylinders, dist, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&vol.seek_pages, n, __ATOMIC_RELAXED);
+}
+
+/* Checks a directory's items, claims and queues its children. A folder
+   kept as a log is read to its end and loses its removed items when it
+   is repaired. */
+void check_folder(int inode) {
+	int filesize = iget(inode, 4), len, nitem, kept = 0, bad = 0, offset = 4, i;
+	int log = vol.features & FEATURE_FOLDER_LOG;
+	char *buf = malloc(filesize + vol.content_bytes + 4), *out;
+	int *children, nchild = 0, outlen = 4;
+
+	len = check_chain(inode, buf, &bad);
+	nitem = 0;
+	if (len >= 4) memcpy(&nitem, buf, 4);
+	if (nitem < 0 || nitem > len) {
+		report(ERR_DIR, "folder %d: claims %d items", inode, nitem);
+		nitem = 0;
+		bad = 1;
+	}
+	if (log) nitem = len > 4 ? (len - 4) / 8 : 0;
+	out = malloc(len + 4);
+	children = malloc(sizeof(int) * (nitem + 1));
+	for (i = 0; i < nitem; i++) {
+		int word, namelen, type, child, ok = 1;
+		char name[4097];
+		if (offset + 4 > len) break;
+		memcpy(&word, buf + offset, 4);
+		namelen = word & ITEM_LEN_MASK;
+		type = (word >> ITEM_TYPE_SHIFT) - 1;
+		if (namelen > 4096 || offset + 8 + namelen > len) break;
+		memcpy(name, buf + offset + 4, namelen);
+		name[namelen] = 0;
+		memcpy(&child, buf + offset + 4 + namelen, 4);
+		offset += 8 + namelen;
+
+		if (log && child == 0) continue;
+		if (!valid_inode(child)) {
+			report(ERR_INODE, "folder %d: item `%s' points to %d, which is no inode", inode, name, child);
+			ok = 0;
+		} else if (namelen == 0) {
+			if (child != vol.root) report(ERR_DIR, "folder %d: root item points to %d", inode, child), ok = 0;
+		} else if (strcmp(name, ".") == 0) {
+			if (child != inode) report(ERR_DIR, "folder %d: `.' points to %d", inode, child), ok = 0;
+		} else if (strcmp(name, "..") == 0) {
+			if (iget(child, 0) != INODE_FOLDER) report(ERR_DIR, "folder %d: `..' is no folder", inode), ok = 0;
+		} else if (!claim_inode(child)) {
+			report(ERR_CROSS, "folder %d: item `%s' names inode %d, which has another name", inode, name, child);
+			ok = 0;
+		} else {
+			if (type >= 0 && type != iget(child, 0)) {
+				report(ERR_TYPE, "folder %d: item `%s' records the wrong type", inode, name);
+				bad = 1;
+			}
+			children[nchild++] = child;
+		}
+		if (!ok) {
+			bad = 1;
+			continue;
+		}
+		type = iget(child, 0);
+		word = namelen | (type + 1) << ITEM_TYPE_SHIFT;
+		memcpy(out + outlen, &word, 4);
+		memcpy(out + outlen + 4, name, namelen);
+		memcpy(out + outlen + 4 + namelen, &child, 4);
+		outlen += 8 + namelen;
+		kept++;
+	}
+	if (log && offset != len) {
+		report(ERR_DIR, "folder %d: content ends inside an item", inode);
+		bad = 1;
+	} else if (!log && i < nitem) {
+		report(ERR_DIR, "folder %d: content ends after %d of %d items", inode, i, nitem);
+		bad = 1;
+	}
+	if (bad) {
+		memcpy(out, &kept, 4);
+		add_fix(inode, outlen, 0, 0, out);
+	} else {
+		free(out);
+	}
+	push(children, nchild);
+	free(children);
+	free(buf);
+}
+
+void *worker(void *arg) {
+	(void) arg;
+	for (;;) {
+		int inode;
+		pthread_mutex_lock(&vol.lock);
+		while (!vol.nqueue && vol.busy) pthread_cond_wait(&vol.more, &vol.lock);
+		if (!vol.nqueue) {
+			pthread_mutex_unlock(&vol.lock);
+			return NULL;
+		}
+		inode = vol.queue[--vol.nqueue];
+		vol.busy++;
+		pthread_mutex_unlock(&vol.lock);
+
+		__atomic_add_fetch(&vol.ninode, 1, __ATOMIC_RELAXED);
+		if (iget(inode, 0) == INODE_FOLDER) {
+			__atomic_add_fetch(&vol.nfolder, 1, __ATOMIC_RELAXED);
+			check_folder(inode);
+		} else {
+			int broken;
+			check_chain(inode, NULL, &broken);
+			if (vol.num_sector) seek_distance(inode);
+		}
+
+		pthread_mutex_lock(&vol.lock);
+		if (--vol.busy == 0 && !vol.nqueue) pthread_cond_broadcast(&vol.more);
+		pthread_mutex_unlock(&vol.lock);
+	}
+}
+
+typedef struct {
+	int from, to;
+	int repair;
+} Range;
+
+/* Compares a slice of the free map with what the walk reached */
+void *check_freemap(void *arg) {
+	Range *r = arg;
+	long long used = 0;
+	int p;
+	for (p = r->from; p < r->to; p++) {
+		unsigned char *map = refs(p);
+		int count = (reserved(p) ? 1 : vol.claimed[p]) + vol.pins[p];
+		if (count > REFS_MAX) count = REFS_MAX;
+		used += count > 0;
+		if (*map && !count) {
+			report(ERR_LEAK, "page %d is marked used but nothing reaches it", p);
+		} else if (!*map && count) {
+			report(ERR_FREE, "page %d is in use but marked free", p);
+		} else if (*map != count) {
+			report(ERR_REFS, "page %d has %d references, the free map counts %d", p, count, *map);
+		} else {
+			continue;
+		}
+		if (r->repair) *map = count;
+	}
+	__atomic_add_fetch(&vol.nused, used, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/* Rewrites a directory through its own, already claimed, chain and cuts
+   the chain after the last page needed */
+void rewrite(Fix *fix) {
+	int p = iget(fix->inode, 16), prev = 0, done = 0;
+
+	if (fix->content && !p && fix->filesize <= vol.inline_bytes) {
+		memcpy(inode_at(fix->inode) + INLINE_OFFSET, fix->content, fix->filesize);
+		iset(fix->inode, 4, fix->filesize);
+		if (vol.features & FEATURE_ENCODING) iset(fix->inode, 12, fix->filesize);
+		return;
+	}
+	if (fix->drop) {
+		/* give back the pages the walk claimed, up to where it stopped */
+		for (p = iget(fix->inode, 16); fix->last && p; p = getint(p, vol.content_bytes)) {
+			/* a page still reached from elsewhere keeps the rest */
+			if (--vol.claimed[p] || p == fix->last) break;
+		}
+		iset(fix->inode, 4, 0);
+		iset(fix->inode, 8, 0);
+		iset(fix->inode, 12, 0);
+		iset(fix->inode, 16, 0);
+		return;
+	}
+	if (!fix->content) {
+		iset(fix->inode, 4, fix->filesize);
+		if (vol.features & FEATURE_ENCODING) iset(fix->inode, 12, fix->filesize);
+		if (fix->last) setint(fix->last, vol.content_bytes, 0);
+		else iset(fix->inode, 16, 0);
+		if (fix->last && (vol.features & FEATURE_TAIL)) iset(fix->inode, INLINE_OFFSET, fix->last);
+		return;
+	}
+	while (done < fix->filesize && p > 0 && p < vol.npage && vol.claimed[p]) {
+		int n = fix->filesize - done < vol.content_bytes ? fix->filesize - done : vol.content_bytes;
+		memcpy(page(p), fix->content + done, n);
+		done += n;
+		prev = p;
+		p = getint(p, vol.content_bytes);
+	}
+	if (prev) setint(prev, vol.content_bytes, 0);
+	else iset(fix->inode, 16, 0);
+	if (prev && (vol.features & FEATURE_TAIL)) iset(fix->inode, INLINE_OFFSET, prev);
+	iset(fix->inode, 4, done);
+	if (vol.features & FEATURE_ENCODING) iset(fix->inode, 12, done);
+	/* what is left of the old chain becomes free */
+	while (p > 0 && p < vol.npage && vol.claimed[p] && !reserved(p)) {
+		vol.claimed[p] = 0;
+		p = getint(p, vol.content_bytes);
+	}
+}
+
+int copy_cmp(const void *a, const void *b) {
+	const Copy *x = a, *y = b;
+	return x->page != y->page ? (x->page > y->page) - (x->page < y->page) : (x->epoch > y->epoch) - (x->epoch < y->epoch);
+}
+
+/* The page a snapshot of the given epoch sees in place of p: the copy of
+   the earliest epoch not before it, as snapshot_translate in fs.c */
+int translate(Copy *copies, int ncopy, int epoch, int p) {
+	int lo = 0, hi = ncopy;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (copies[mid].page < p || (copies[mid].page == p && copies[mid].epoch < epoch)) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo < ncopy && copies[lo].page == p ? copies[lo].copy : p;
+}
+
+/* Claims a snapshot file and returns its content, NULL when it is unsound */
+char *snapshot_file(int inode, int *len) {
+	char *buf;
+	int broken;
+	if (!valid_inode(inode) || iget(inode, 0) != INODE_FILE || encoded(inode) || !claim_inode(inode)) {
+		report(ERR_SNAP, "snapshot file %d is no inode of its own", inode);
+		return NULL;
+	}
+	__atomic_add_fetch(&vol.ninode, 1, __ATOMIC_RELAXED);
+	buf = malloc(stored_size(inode) + vol.content_bytes);
+	*len = check_chain(inode, buf, &broken);
+	if (broken) {
+		report(ERR_SNAP, "snapshot file %d: chain is broken", inode);
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/* Reads the snapshot table before the walk, claims its files and counts
+   the pins every snapshot holds. Nothing here is repaired: without a
+   sound table the pins are unknown and the free map is left alone. */
+int check_snapshots(void) {
+	int table, len, nsnap, ncopy, offset = 12, i;
+	char *buf;
+	Copy *copies;
+
+	if (!vol.freemap_first || !(table = getint(0, SUPER_SNAPSHOTS))) return 1;
+	if (!(buf = snapshot_file(table, &len))) return 0;
+	memcpy(&nsnap, buf + 4, 4);
+	memcpy(&ncopy, buf + 8, 4);
+	if (len < 12 || nsnap < 0 || ncopy < 0 || ncopy > len / 12) {
+		report(ERR_SNAP, "snapshot table %d does not parse", table);
+		free(buf);
+		return 0;
+	}
+	/* skip to the copies, then come back for the snapshots */
+	for (i = 0; i < nsnap && offset + 12 <= len; i++) {
+		int namelen;
+		memcpy(&namelen, buf + offset + 8, 4);
+		if (namelen < 0 || namelen > len) break;
+		offset += 12 + namelen;
+	}
+	if (i < nsnap || offset + 12 * ncopy > len) {
+		report(ERR_SNAP, "snapshot table %d does not parse", table);
+		free(buf);
+		return 0;
+	}
+	copies = malloc(sizeof(Copy) * (ncopy + 1));
+	for (i = 0; i < ncopy; i++) memcpy(&copies[i], buf + offset + 12 * i, 12);
+	qsort(copies, ncopy, sizeof(Copy), copy_cmp);
+	for (i = 0, offset = 12; i < nsnap; i++) {
+		int epoch, bitmap, namelen, nbit, p;
+		unsigned char *bits;
+		memcpy(&epoch, buf + offset, 4);
+		memcpy(&bitmap, buf + offset + 4, 4);
+		memcpy(&namelen, buf + offset + 8, 4);
+		offset += 12 + namelen;
+		if (!(bits = (unsigned char *) snapshot_file(bitmap, &nbit))) continue;
+		for (p = 0; p < nbit * 8 && p < vol.npage; p++) {
+			if (bits[p >> 3] & 1 << (p & 7)) {
+				int q = translate(copies, ncopy, epoch, p);
+				if (q > 0 && q < vol.npage) vol.pins[q]++;
+			}
+		}
+		free(bits);
+	}
+	free(copies);
+	free(buf);
+	return 1;
+}
+
+void usage(char *name) {
+	fprintf(stderr, "Usage: %s [-j threads] [-u stripe_unit] [-c sectors_per_cylinder] [-r] image[,image...]\n", name);
+	exit(8);
+}
+
+int main(int argc, char *argv[]) {
+	pthread_t threads[MAX_THREADS];
+	Range ranges[MAX_THREADS];
+	int nthread = sysconf(_SC_NPROCESSORS_ONLN), repair = 0, snapshots, opt, i;
+	long long min_sector = -1, total = 0;
+	char *spec, *name;
+	double start = now_us();
+	Fix *fix;
+
+	vol.stripe_unit = 4;
+	while ((opt = getopt(argc, argv, "j:u:c:r")) != -1) {
+		switch (opt) {
+		case 'j': nthread = atoi(optarg); break;
+		case 'u': vol.stripe_unit = atoi(optarg); break;
+		case 'c': vol.num_sector = atoi(optarg); break;
+		case 'r': repair = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1 || vol.stripe_unit <= 0 || vol.num_sector < 0) usage(argv[0]);
+	if (nthread < 1) nthread = 1;
+	if (nthread > MAX_THREADS) nthread = MAX_THREADS;
+
+	spec = strdup(argv[optind]);
+	while ((name = strsep(&spec, ",")) != NULL && vol.nimage < MAX_IMAGES) {
+		struct stat st;
+		int fd = open(name, repair ? O_RDWR : O_RDONLY);
+		if (fd < 0 || fstat(fd, &st) < 0) {
+			fprintf(stderr, "Cannot open %s\n", name);
+			exit(8);
+		}
+		vol.images[vol.nimage] = mmap(NULL, st.st_size, repair ? PROT_READ | PROT_WRITE : PROT_READ,
+			MAP_SHARED, fd, 0);
+		if (vol.images[vol.nimage] == MAP_FAILED) {
+			fprintf(stderr, "Cannot map %s\n", name);
+			exit(8);
+		}
+		if (min_sector < 0 || st.st_size / SECTOR_SIZE < min_sector) min_sector = st.st_size / SECTOR_SIZE;
+		vol.nimage++;
+		close(fd);
+	}
+	/* the volume size fs works out in storage_open */
+	if (vol.nimage == 1) total = min_sector / SECTOR_SIZE * SECTOR_SIZE;
+	else total = min_sector / vol.stripe_unit * vol.stripe_unit * vol.nimage / SECTOR_SIZE * SECTOR_SIZE;
+	/* fs_mount in fs.c */
+	vol.shift = 0;
+	vol.freemap_first = 0;
+	if (total > 0 && getint(0, 0) == SUPER_MAGIC && getint(0, 4) >= 8 && getint(0, 4) <= PAGE_SHIFT_MAX
+			&& getint(0, 8) == total >> (getint(0, 4) - 8)) {
+		vol.shift = getint(0, 4) - 8;
+		vol.freemap_first = 1;
+		vol.features = getint(0, 12);
+	}
+	if (vol.nimage > 1 && vol.stripe_unit % (1 << vol.shift)) {
+		fprintf(stderr, "The stripe unit must hold whole %d byte pages\n", SECTOR_SIZE << vol.shift);
+		exit(8);
+	}
+	vol.page_size = SECTOR_SIZE << vol.shift;
+	vol.content_bytes = vol.page_size - 4;
+	vol.inline_bytes = vol.content_bytes - INLINE_OFFSET;
+	vol.npage = (int) (total >> vol.shift);
+	vol.freemap_pages = (vol.npage + vol.page_size - 1) / vol.page_size;
+	vol.root = vol.freemap_first + vol.freemap_pages;
+	vol.magic_offset = vol.content_bytes;
+	vol.data_first = vol.root + 1;
+	if (vol.features & FEATURE_ITABLE) {
+		vol.itable_first = vol.root;
+		vol.itable_pages = getint(0, SUPER_ITABLE);
+		vol.slots = vol.page_size / SLOT_BYTES;
+		vol.nslot = vol.itable_pages * vol.slots;
+		vol.inline_bytes = 0;
+		vol.magic_offset = SLOT_MAGIC;
+		vol.data_first = vol.itable_first + vol.itable_pages;
+		vol.root = 1;
+	}
+	if (vol.npage <= vol.data_first || vol.itable_pages < 0) {
+		fprintf(stderr, "The volume is too small\n");
+		exit(8);
+	}
+	printf("%d pages of %d bytes, %d free map pages, %d threads\n", vol.npage, vol.page_size, vol.freemap_pages, nthread);
+	if (vol.itable_pages) printf("%d inode table pages, %d inodes\n", vol.itable_pages, vol.nslot);
+
+	vol.claimed = calloc(vol.npage, sizeof(unsigned short));
+	vol.pins = calloc(vol.npage, sizeof(unsigned short));
+	vol.iclaimed = calloc(vol.nslot + 1, sizeof(unsigned short));
+	pthread_mutex_init(&vol.lock, NULL);
+	pthread_cond_init(&vol.more, NULL);
+	if (!valid_inode(vol.root) || iget(vol.root, 0) != INODE_FOLDER) {
+		printf("The root inode %d is missing, the volume is not formatted\n", vol.root);
+		return 4;
+	}
+	claim_inode(vol.root);
+	snapshots = check_snapshots();
+	push(&vol.root, 1);
+	for (i = 0; i < nthread; i++) pthread_create(&threads[i], NULL, worker, NULL);
+	for (i = 0; i < nthread; i++) pthread_join(threads[i], NULL);
+
+	if (repair) {
+		for (fix = vol.fixes; fix; fix = fix->next) rewrite(fix);
+	}
+	/* a slot in use that nothing names is lost, like an unreachable page;
+	   a snapshot may still see it where the table page is pinned */
+	for (i = 1; i < vol.nslot; i++) {
+		if (vol.iclaimed[i] || iget(i, SLOT_MAGIC) != INODE_MAGIC) continue;
+		report(ERR_ILEAK, "inode %d is in use but nothing names it", i);
+		if (repair && !vol.pins[inode_page(i)]) iset(i, SLOT_MAGIC, 0);
+	}
+	for (i = 0; i < nthread; i++) {
+		ranges[i].from = (int) ((long long) vol.npage * i / nthread);
+		ranges[i].to = (int) ((long long) vol.npage * (i + 1) / nthread);
+		ranges[i].repair = repair && snapshots;
+		pthread_create(&threads[i], NULL, check_freemap, &ranges[i]);
+	}
+	for (i = 0; i < nthread; i++) pthread_join(threads[i], NULL);
+
+	total = 0;
+	for (i = 0; i < ERR_NUM; i++) {
+		if (vol.errors[i]) printf("%lld %s\n", vol.errors[i], err_names[i]);
+		total += vol.errors[i];
+	}
+	if (vol.num_sector && vol.nchained) {
+		printf("%lld files in chains, reading one crosses %.1f cylinders on average, %.2f per page\n",
+			vol.nchained, (double) vol.seek_cylinders / vol.nchained, (double) vol.seek_cylinders / vol.seek_pages);
+	}
+	printf("%lld inodes (%lld folders), %lld pages in use, %lld errors%s, %.3f s\n",
+		vol.ninode, vol.nfolder, vol.nused, total, total && repair ? " repaired" : "", (now_us() - start) / 1e6);
+	if (repair) {
+		for (i = 0; i < vol.nimage; i++) msync(vol.images[i], (size_t) min_sector * SECTOR_SIZE, MS_SYNC);
+	}
+	return total == 0 ? 0 : repair ? 1 : 4;
+}
@@ -0,0 +1,347 @@
+/*****************************************************************
+* Replays a request trace recorded by `fs -t trace` against a
+* running fs server.
+*
+* Every traced session gets a connection of its own and its
+* requests are re-issued in the recorded order. With -s SPEED the
+* requests go out on the recorded schedule scaled by SPEED (1 is
+* real time, 2 twice as fast); with -s 0 they are issued one at a
+* time, each waiting for the reply of the one before, which makes
+* the run deterministic whatever the server does.
+*
+* The trace also holds the length of every reply, which is how the
+* end of a reply is recognised. A reply whose length differs from
+* the recording means the run has diverged from the original; such
+* requests are counted and reported, and replay then exits with 1.
+* A put is traced with the content it uploaded, which is sent
+* again after its request line; traces written before that was
+* recorded are refused when they hold a put.
+*
+* The report is one JSON object on stdout, like bench, plus a
+* readable summary on stderr.
+******************************************************************/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <netdb.h>
+
+#define TRACE_MAGIC		"FSTRACE2"
+#define TRACE_MAGIC_OLD	"FSTRACE1"	/* the same, without put content */
+#define TRACE_HEADER	(12)
+#define TRACE_PAYLOAD	(0x8000)	/* in len, the content of a put follows */
+#define TRACE_CLOSED	(0xFFFF)
+#define MAX_SESSION		(65536)
+#define MAX_OUTSTANDING	(1024)
+#define STALL_US		(1e6)	/* a reply this late is taken as diverged */
+
+typedef struct {
+	double at;		/* arrival time since the first request, in us */
+	int session;
+	int len;		/* -1 when the session went away */
+	int nreply;
+	char *line;
+	int npayload;	/* the content a put uploads, sent after line */
+	char *payload;
+} Record;
+
+typedef struct {
+	int sock;
+	int closing;
+	long long want, got;
+	long long qwant[MAX_OUTSTANDING];
+	double qt[MAX_OUTSTANDING];
+	int qhead, qlen;
+} Conn;
+
+Conn *conns[MAX_SESSION];
+Conn *active[MAX_SESSION];		/* connections that may still be open */
+int nactive;
+struct pollfd fds[MAX_SESSION];
+Conn *polled[MAX_SESSION];
+double *lat;
+int nlat;
+long long diverged, pending;
+
+double now_us() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+int readint(unsigned char *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | p[3] << 24;
+}
+
+/* Load the whole trace, returns the number of records */
+int load_trace(const char *path, Record **records) {
+	FILE *fp;
+	unsigned char header[TRACE_HEADER];
+	char magic[sizeof(TRACE_MAGIC)] = "";
+	double at = 0;
+	int n = 0, cap = 0;
+
+	if ((fp = fopen(path, "rb")) == NULL) {
+		fprintf(stderr, "Cannot open %s\n", path);
+		exit(1);
+	}
+	if (fread(magic, 1, strlen(TRACE_MAGIC), fp) != strlen(TRACE_MAGIC)
+			|| (strcmp(magic, TRACE_MAGIC) != 0 && strcmp(magic, TRACE_MAGIC_OLD) != 0)) {
+		fprintf(stderr, "%s is not a trace\n", path);
+		exit(1);
+	}
+	*records = NULL;
+	while (fread(header, 1, TRACE_HEADER, fp) == TRACE_HEADER) {
+		Record *r;
+		int payload;
+		if (n == cap) {
+			cap = cap ? cap * 2 : 1024;
+			*records = realloc(*records, sizeof(Record) * cap);
+		}
+		r = &(*records)[n];
+		at += readint(header);
+		r->at = n ? at : 0;
+		r->session = header[4] | header[5] << 8;
+		r->len = header[6] | header[7] << 8;
+		r->nreply = readint(header + 8);
+		r->line = NULL;
+		r->npayload = 0;
+		r->payload = NULL;
+		if (r->len == TRACE_CLOSED) {
+			r->len = -1;
+			n++;
+			continue;
+		}
+		payload = r->len & TRACE_PAYLOAD;
+		r->len &= ~TRACE_PAYLOAD;
+		r->line = malloc(r->len + 2);
+		if (fread(r->line, 1, r->len, fp) != (size_t) r->len) break;
+		r->line[r->len] = '\n';
+		r->line[r->len + 1] = 0;
+		if (payload) {
+			if (fread(header, 1, 4, fp) != 4) break;
+			r->npayload = readint(header);
+			r->payload = malloc(r->npayload + 1);
+			if (fread(r->payload, 1, r->npayload, fp) != (size_t) r->npayload) break;
+		} else if (strncmp(r->line, "put ", 4) == 0) {
+			fprintf(stderr, "%s holds a put without its content, it cannot be replayed\n", path);
+			exit(1);
+		}
+		n++;
+	}
+	fclose(fp);
+	return n;
+}
+
+int connect_to(int port) {
+	struct sockaddr_in addr;
+	struct hostent *host;
+	int s, one = 1;
+
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+		fprintf(stderr, "Socket error\n");
+		exit(1);
+	}
+	addr.sin_family = AF_INET;
+	host = gethostbyname("localhost");
+	addr.sin_port = htons(port);
+	memcpy(&addr.sin_addr.s_addr, host->h_addr, host->h_length);
+	if (connect(s, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		fprintf(stderr, "Connect error\n");
+		exit(1);
+	}
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return s;
+}
+
+void send_all(int s, const char *buf, int n) {
+	int k, done = 0;
+	while (done < n) {
+		if ((k = write(s, buf + done, n - done)) <= 0) {
+			fprintf(stderr, "Send error\n");
+			exit(1);
+		}
+		done += k;
+	}
+}
+
+void record(double us) {
+	static int cap;
+	if (nlat == cap) {
+		cap = cap ? cap * 2 : 1024;
+		lat = realloc(lat, sizeof(double) * cap);
+	}
+	lat[nlat++] = us;
+}
+
+void conn_close(Conn *c) {
+	if (c->sock >= 0) close(c->sock);
+	c->sock = -1;
+	diverged += c->qlen;
+	pending -= c->qlen;
+	c->qlen = 0;
+}
+
+/* Give up on the replies still expected, the run no longer matches the trace */
+void conn_skip(Conn *c) {
+	diverged += c->qlen;
+	pending -= c->qlen;
+	c->qlen = 0;
+	c->got = c->want;
+	if (c->closing) conn_close(c);
+}
+
+void issue(Conn *c, Record *r, double at) {
+	c->want += r->nreply;
+	c->qwant[(c->qhead + c->qlen) % MAX_OUTSTANDING] = c->want;
+	c->qt[(c->qhead + c->qlen) % MAX_OUTSTANDING] = at;
+	c->qlen++;
+	pending++;
+	send_all(c->sock, r->line, r->len + 1);
+	if (r->payload) send_all(c->sock, r->payload, r->npayload);
+}
+
+/* Count what arrived and retire every request whose reply is complete */
+void collect(Conn *c) {
+	char buf[65536];
+	int k;
+
+	if ((k = recv(c->sock, buf, sizeof(buf), 0)) <= 0) {
+		conn_close(c);
+		return;
+	}
+	c->got += k;
+	while (c->qlen && c->got >= c->qwant[c->qhead]) {
+		record(now_us() - c->qt[c->qhead]);
+		c->qhead = (c->qhead + 1) % MAX_OUTSTANDING;
+		c->qlen--;
+		pending--;
+	}
+	if (c->closing && c->qlen == 0) conn_close(c);
+}
+
+int dblcmp(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+double pct(double q) {
+	return nlat ? lat[(int) (q * (nlat - 1))] : 0;
+}
+
+void usage(char *name) {
+	fprintf(stderr, "Usage: %s [-s speed] [-f] trace port\n"
+		"speed 1 replays in real time, 0 one request at a time\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	Record *records;
+	int nrecord, next = 0, format = 0, port, opt, i;
+	double speed = 1, start, progress, t;
+
+	while ((opt = getopt(argc, argv, "s:f")) != -1) {
+		switch (opt) {
+		case 's': speed = atof(optarg); break;
+		case 'f': format = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2 || speed < 0) usage(argv[0]);
+	nrecord = load_trace(argv[optind], &records);
+	port = atoi(argv[optind + 1]);
+
+	if (format) {
+		char reply[16];
+		int s = connect_to(port);
+		send_all(s, "f\n", 2);
+		if (recv(s, reply, sizeof(reply), 0) <= 0) {
+			fprintf(stderr, "Cannot format the volume\n");
+			exit(1);
+		}
+		close(s);
+	}
+
+	start = progress = now_us();
+	for (;;) {
+		int nfds = 0, k;
+		double timeout = 100000;
+		struct timespec ts;
+		t = now_us();
+		while (next < nrecord) {
+			Record *r = &records[next];
+			Conn *c = conns[r->session];
+			double at = start + r->at / (speed > 0 ? speed : 1);
+			if (speed > 0 ? at > t : pending > 0) break;
+			if (speed > 0 && c && c->qlen == MAX_OUTSTANDING) break;
+			if (r->len < 0) {
+				if (c && c->qlen == 0) conn_close(c);
+				else if (c) c->closing = 1;
+				next++;
+				continue;
+			}
+			if (c == NULL) {
+				c = conns[r->session] = calloc(1, sizeof(Conn));
+				c->sock = -1;
+			}
+			if (c->sock < 0) {
+				c->sock = connect_to(port);
+				active[nactive++] = c;
+				c->closing = 0;
+				c->want = c->got = 0;
+			}
+			issue(c, r, speed > 0 ? at : t);
+			next++;
+		}
+		if (next == nrecord && pending == 0) break;
+		if (speed > 0 && next < nrecord) {
+			double wait = start + records[next].at / speed - t;
+			if (wait < timeout) timeout = wait < 0 ? 0 : wait;
+		}
+		for (i = 0; i < nactive; i++) {
+			if (active[i]->sock < 0) {
+				active[i--] = active[--nactive];
+				continue;
+			}
+			fds[nfds].fd = active[i]->sock;
+			fds[nfds].events = POLLIN;
+			polled[nfds++] = active[i];
+		}
+		/* sleep to the microsecond, a busy wait would steal the server's CPU */
+		ts.tv_sec = (time_t) (timeout / 1e6);
+		ts.tv_nsec = (long) (timeout - ts.tv_sec * 1e6) * 1000;
+		if ((k = ppoll(fds, nfds, &ts, NULL)) < 0) break;
+		if (k > 0) progress = now_us();
+		for (i = 0; i < nfds; i++)
+			if (fds[i].revents & (POLLIN | POLLHUP)) collect(polled[i]);
+		if (pending && now_us() - progress > STALL_US) {
+			for (i = 0; i < nfds; i++)
+				if (polled[i]->qlen) conn_skip(polled[i]);
+			progress = now_us();
+		}
+	}
+	t = now_us() - start;
+	for (i = 0; i < MAX_SESSION; i++)
+		if (conns[i]) {
+			if (conns[i]->sock >= 0 && conns[i]->got != conns[i]->want) diverged++;
+			if (conns[i]->sock >= 0) close(conns[i]->sock);
+		}
+
+	qsort(lat, nlat, sizeof(double), dblcmp);
+	printf("{\"requests\":%d,\"speed\":%g,\"duration_s\":%.3f,\"ops_per_s\":%.1f,\"diverged\":%lld,"
+		"\"p50_us\":%.0f,\"p99_us\":%.0f,\"p999_us\":%.0f,\"max_us\":%.0f}\n",
+		nlat, speed, t / 1e6, nlat / (t / 1e6), diverged, pct(0.5), pct(0.99), pct(0.999), pct(1));
+	fprintf(stderr, "%d requests in %.3f s, %.1f ops/s, %lld diverged\n", nlat, t / 1e6, nlat / (t / 1e6), diverged);
+	fprintf(stderr, "p50 %.0f us, p99 %.0f us, p999 %.0f us, max %.0f us\n", pct(0.5), pct(0.99), pct(0.999), pct(1));
+	return diverged ? 1 : 0;
+}